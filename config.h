@@ -2,6 +2,9 @@
 #define CONFIG_H
 
 #define TB_IMPL
+#ifdef __linux__
+#define TB_OPT_EPOLL
+#endif
 #include "termbox2.h"
 
 /*
@@ -23,11 +26,31 @@ if 1 exit when 00:00:00 reached in timer mode
 */
 #define AUTO_EXIT            0
 
+/*
+if 1 the timer also shows tenths of a second, as HH:MM:SS.d
+*/
+#define TIMER_TENTHS         0
+
 /*
 frames per second
 */
 #define FPS                  1
 
+/*
+output bytes per second the terminal line can take, e.g. 960 for a 9600
+baud serial console. Over it the clock takes the small font and updates
+fewer symbols per frame. 0 for no limit, -1 to use the tty's line speed
+*/
+#define BYTES_PER_SEC        0
+
+/*
+font pixels per cell of the large font: 1, 2 for half blocks (two pixels
+stacked in a cell) or 4 for quadrant blocks (2x2 pixels in a cell). Block
+elements need a UTF-8 terminal and a font having them; quadrants also
+halve the width the large font needs
+*/
+#define PIXELS_PER_CELL      1
+
 /*
 large font <-> small font change
 */
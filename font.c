@@ -78,6 +78,13 @@ g_font_small[256] = {
         "   ",
         " # ",
         "   "
+    },
+    ['.'] = {
+        "   ",
+        "   ",
+        "   ",
+        "   ",
+        " # "
     }
 };
 
@@ -203,5 +210,60 @@ g_font_large[256] = {
         "    ####    ",
         "            ",
         "            ",
+    },
+    ['.'] = {
+        "            ",
+        "            ",
+        "            ",
+        "            ",
+        "            ",
+        "            ",
+        "            ",
+        "            ",
+        "    ####    ",
+        "            ",
     }
 };
+
+FontGlyph
+g_glyphs_small[256];
+
+FontGlyph
+g_glyphs_large[256];
+
+/* Turn every symbol picture into the list of its lit runs */
+static void
+compile_font(FontGlyph *glyphs, const char *data, int w, int h)
+{
+    int code, x, y, x0;
+    const char *row;
+    FontGlyph *glyph;
+
+    for (code = 0; code < 256; code++) {
+        glyph         = &glyphs[code];
+        glyph->nspans = 0;
+        for (y = 0; y < h; y++) {
+            row = data+(code*h+y)*(w+1);
+            for (x = 0; x < w;) {
+                if (row[x] != '#') {
+                    x++;
+                    continue;
+                }
+                for (x0 = x; x < w && row[x] == '#'; x++)
+                    ;
+                glyph->spans[glyph->nspans++] = (FontSpan){
+                    .x = x0, .y = y, .w = x-x0,
+                };
+            }
+        }
+    }
+}
+
+void
+compile_fonts(void)
+{
+    compile_font(g_glyphs_small, (const char *)g_font_small,
+            SMALL_FONT_WIDTH, SMALL_FONT_HEIGHT);
+    compile_font(g_glyphs_large, (const char *)g_font_large,
+            LARGE_FONT_WIDTH, LARGE_FONT_HEIGHT);
+}
@@ -6,10 +6,29 @@
 #define LARGE_FONT_WIDTH  12
 #define LARGE_FONT_HEIGHT 10
 
+/* a row can't hold more runs than every other pixel lit */
+#define MAX_GLYPH_SPANS   (LARGE_FONT_HEIGHT*(LARGE_FONT_WIDTH+1)/2)
+
 typedef const char SmallFontChar[SMALL_FONT_HEIGHT][SMALL_FONT_WIDTH+1];
 typedef const char LargeFontChar[LARGE_FONT_HEIGHT][LARGE_FONT_WIDTH+1];
 
+/* horizontal run of lit pixels */
+typedef struct {
+    unsigned char x, y, w;
+} FontSpan;
+
+/* symbol compiled from the '#' pictures below */
+typedef struct {
+    int nspans;
+    FontSpan spans[MAX_GLYPH_SPANS];
+} FontGlyph;
+
 extern SmallFontChar g_font_small[256];
 extern LargeFontChar g_font_large[256];
 
+extern FontGlyph g_glyphs_small[256];
+extern FontGlyph g_glyphs_large[256];
+
+void compile_fonts(void);
+
 #endif
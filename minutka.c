@@ -9,6 +9,14 @@ char
 #include "arg.h"
 
 #define MS_PER_FRAME 1000 / FPS
+#define PREPARE_MS   50 /* render the next tick this long before it */
+#define PREPARE_NS   (PREPARE_MS*1000000LL)
+#define SPRITE_SETS  4  /* small and large font, each plain and blinking */
+#define SPRITE_CACHE 64 /* symbol changes remembered per set */
+#define TEXT_LEN     8  /* symbols in "HH:MM:SS" */
+#define TEXT_MAX     10 /* symbols in "HH:MM:SS.d" */
+#define NS_PER_SEC   1000000000LL
+#define ZONE_SCAN    (400*86400L) /* how far ahead to look for a DST change */
 
 /* types */
 
@@ -22,17 +30,56 @@ typedef struct {
 } Pos;
 
 typedef struct {
-    int w, h;
+    int w, h;   /* in cells */
+    int sx, sy; /* font pixels per cell across and down, 1 or 2 */
     uintattr_t fg, bg;
-    void* data;
+    FontGlyph *glyphs;
 } Font;
 
+/* What was rendered last time, used to redraw only changed symbols */
+typedef struct {
+    int valid;
+    int blink;
+    char text[TEXT_MAX+1];
+    Font font;
+    Pos start;
+} Frame;
+
+/* Cells that change when one symbol replaces another, pre-encoded */
+typedef struct {
+    int from, to; /* from is -1 for an empty bounding box */
+    struct tb_sprite sprite;
+} Change;
+
+/* Symbol changes of one font look, built for termbox on first use */
+typedef struct {
+    Font font;
+    int count;
+    Change changes[SPRITE_CACHE];
+} SpriteSet;
+
 typedef struct {
     char mode;
     int autoexit; /* flag -e: exit when 00:00:00 reached in timer mode */
     Font font;
     Pos center;
-    time_t curtime, starttime, endtime;
+    Frame frame;
+    int textlen;
+    /* the display changes once a tick: a second of the wall clock, or a
+     * second or tenth of the monotonic clock lined up with the timer's
+     * deadline by `phase`. Ticks count from the clock's epoch */
+    clockid_t clock;
+    long long tick_ns, phase;
+    long long curtime, endtime; /* ticks shown and of the timer's expiry */
+    long long ready; /* tick of the frame prepared ahead, 0 if none */
+    int held;        /* whether it changed anything, so tb_prepare holds it */
+    long utcoff;     /* local zone's offset from UTC in seconds, */
+    time_t tz_from;  /* in effect from this time, */
+    time_t tz_until; /* until the next DST change */
+    long budget;  /* output bytes per second, 0 for no limit */
+    long credit;  /* bytes that may be sent now, negative when in debt */
+    long charged; /* estimates taken from the credit since the last present */
+    struct timespec refilled; /* when credit was last topped up */
 } State;
 
 /* help funcs */
@@ -56,6 +103,15 @@ State
 int
 g_last_errno = 0;
 
+SpriteSet
+g_sprites[SPRITE_SETS];
+
+int
+g_sprites_next = 0;
+
+volatile sig_atomic_t
+g_reload_zone = 0;
+
 /* main logic */
 
 int
@@ -72,135 +128,529 @@ check_terminal()
     return 0;
 }
 
-/* Position is the upper-left corner of the symbol's bounding box */
+void
+free_sprite_set(SpriteSet *set)
+{
+    int i;
+
+    for (i = 0; i < set->count; i++)
+        tb_sprite_free(&set->changes[i].sprite);
+    set->count = 0;
+}
+
+void
+free_sprites()
+{
+    int i;
+
+    for (i = 0; i < SPRITE_SETS; i++)
+        free_sprite_set(&g_sprites[i]);
+}
+
 int
-draw_symbol(int code, Pos *pos, Font *font)
+font_equal(Font *a, Font *b)
 {
-    int dx, dy;
+    return a->glyphs == b->glyphs && a->w == b->w && a->h == b->h
+        && a->sx == b->sx && a->sy == b->sy
+        && a->fg == b->fg && a->bg == b->bg;
+}
 
-    if (code < 0 || code > 255)
-        return g_last_errno = ERR_DRAW_SYMBOL;
-    for (dy = 0; dy < font->h; dy++) {
-        for (dx = 0; dx < font->w; dx++) {
-            switch (font->w) {
-            case SMALL_FONT_WIDTH: {
-                    SmallFontChar *fontdata;
-
-                    fontdata = (SmallFontChar *)font->data;
-                    if (fontdata[code][dy][dx] == '#')
-                        tb_set_cell(pos->x+dx, pos->y+dy, ' ',
-                                font->fg, font->bg);
-                    break;
-                }
-            case LARGE_FONT_WIDTH: {
-                    LargeFontChar *fontdata;
-
-                    fontdata = (LargeFontChar *)font->data;
-                    if (fontdata[code][dy][dx] == '#')
-                        tb_set_cell(pos->x+dx, pos->y+dy, ' ',
-                                font->fg, font->bg);
-                    break;
-                }
-            }
+/* Mark the lit pixels of each cell of the symbol as bits, 1 and 2 for
+ * the upper left and right ones, 4 and 8 for the lower. A pixel as wide
+ * as the cell sets both bits of its row. -1 marks nothing */
+void
+light_symbol(int code, Font *font, char *lit)
+{
+    int x, bits;
+    FontSpan *span, *end;
+
+    memset(lit, 0, font->w*font->h);
+    if (code < 0)
+        return;
+
+    span = font->glyphs[code].spans;
+    end  = span+font->glyphs[code].nspans;
+    for (; span < end; span++) {
+        for (x = span->x; x < span->x+span->w; x++) {
+            bits = font->sx == 2? 1 << x%2: 3;
+            if (font->sy == 2)
+                bits <<= span->y%2*2;
+            else
+                bits |= bits << 2;
+            lit[span->y/font->sy*font->w+x/font->sx] |= bits;
         }
     }
+}
 
+/* The cell showing the lit pixels in `bits`. A cell fully lit or unlit
+ * is a space in the background color, so a one pixel cell font looks as
+ * it always did; the others are block elements in the text color */
+struct tb_cell
+pixel_cell(int bits, Font *font)
+{
+    static const uint32_t blocks[16] = {
+        ' ',    0x2598, 0x259d, 0x2580, 0x2596, 0x258c, 0x259e, 0x259b,
+        0x2597, 0x259a, 0x2590, 0x259c, 0x2584, 0x2599, 0x259f, ' ',
+    };
+
+    if (bits == 15)
+        return (struct tb_cell){
+            .ch = ' ', .fg = font->fg, .bg = font->bg,
+        };
+    /* a text color of the terminal's default hides the text entirely */
+    if (bits == 0 || font->bg == TB_DEFAULT)
+        return (struct tb_cell){
+            .ch = ' ', .fg = TB_DEFAULT, .bg = TB_DEFAULT,
+        };
+    return (struct tb_cell){
+        .ch = blocks[bits], .fg = font->bg, .bg = TB_DEFAULT,
+    };
+}
+
+/* Find the sprite turning symbol `from` into symbol `to`, building it on
+ * first use. Cells looking the same in both are left transparent */
+struct tb_sprite
+*get_sprite(int from, int to, Font *font)
+{
+    int i;
+    SpriteSet *set;
+    Change *change;
+    char litfrom[LARGE_FONT_WIDTH*LARGE_FONT_HEIGHT];
+    char litto[LARGE_FONT_WIDTH*LARGE_FONT_HEIGHT];
+    struct tb_cell cells[LARGE_FONT_WIDTH*LARGE_FONT_HEIGHT];
+
+    for (i = 0; i < SPRITE_SETS; i++) {
+        set = &g_sprites[i];
+        if (font_equal(&set->font, font))
+            break;
+    }
+    if (i == SPRITE_SETS) {
+        set = &g_sprites[g_sprites_next];
+        g_sprites_next = (g_sprites_next+1)%SPRITE_SETS;
+        free_sprite_set(set);
+        set->font = *font;
+    }
+
+    for (i = 0; i < set->count; i++)
+        if (set->changes[i].from == from && set->changes[i].to == to)
+            return &set->changes[i].sprite;
+
+    if (set->count == SPRITE_CACHE)
+        free_sprite_set(set);
+
+    light_symbol(from, font, litfrom);
+    light_symbol(to, font, litto);
+    memset(cells, 0, sizeof(cells));
+    for (i = 0; i < font->w*font->h; i++)
+        if (litto[i] != litfrom[i])
+            cells[i] = pixel_cell(litto[i], font);
+
+    change = &set->changes[set->count];
+    if (tb_sprite_init(&change->sprite, font->w, font->h, cells) != TB_OK)
+        return NULL;
+    change->from = from;
+    change->to   = to;
+    set->count++;
+    return &change->sprite;
+}
+
+/* Position is the upper-left corner of the symbol's bounding box, which
+ * is expected to hold symbol `from` */
+int
+draw_symbol(int from, int to, Pos *pos, Font *font)
+{
+    struct tb_sprite *sprite;
+
+    if (from < -1 || from > 255 || to < 0 || to > 255
+            || !(sprite = get_sprite(from, to, font)))
+        return g_last_errno = ERR_DRAW_SYMBOL;
+
+    tb_sprite_blit(sprite, pos->x, pos->y);
+    return 0;
+}
+
+/* Output budget from the config, or from the tty's line speed */
+long
+line_budget()
+{
+    static const struct {
+        speed_t speed;
+        long baud;
+    } bauds[] = {
+        { B300, 300 },       { B1200, 1200 },     { B2400, 2400 },
+        { B4800, 4800 },     { B9600, 9600 },     { B19200, 19200 },
+        { B38400, 38400 },   { B57600, 57600 },   { B115200, 115200 },
+        { B230400, 230400 },
+    };
+    int i, ttyfd, resizefd;
+    struct termios tios;
+    speed_t speed;
+
+    if (BYTES_PER_SEC >= 0)
+        return BYTES_PER_SEC;
+    if (tb_get_fds(&ttyfd, &resizefd) != TB_OK || ttyfd < 0
+            || tcgetattr(ttyfd, &tios) < 0)
+        return 0;
+
+    speed = cfgetospeed(&tios);
+    for (i = 0; i < (int)(sizeof(bauds)/sizeof(bauds[0])); i++)
+        if (bauds[i].speed == speed)
+            return bauds[i].baud/10; /* start, 8 data and stop bits */
+    return 0;
+}
+
+/* Top up the output credit for the time passed, up to a second's worth */
+void
+refill_credit()
+{
+    struct timespec now;
+    long long ns;
+
+    if (!g_state->budget)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec-g_state->refilled.tv_sec)*1000000000LL
+        + now.tv_nsec-g_state->refilled.tv_nsec;
+    g_state->credit  += g_state->budget*ns/1000000000LL;
+    g_state->refilled = now;
+    if (g_state->credit > g_state->budget)
+        g_state->credit = g_state->budget;
+}
+
+/* Take `n` estimated bytes from the credit, until present_frame() knows
+ * what was actually sent */
+void
+take_credit(long n)
+{
+    g_state->credit  -= n;
+    g_state->charged += n;
+}
+
+/* Take the bytes for turning symbol `from` into `to` from the credit, or
+ * return -1 if it has run out. The last symbol may overdraw it, so even
+ * the costliest one gets through eventually */
+int
+spend_credit(int from, int to, Font *font)
+{
+    struct tb_sprite *sprite;
+    size_t nbuf;
+
+    if (!g_state->budget)
+        return 0;
+    if (g_state->credit <= 0)
+        return -1;
+    if ((sprite = get_sprite(from, to, font))
+            && tb_sprite_size(sprite, &nbuf) == TB_OK)
+        take_credit(nbuf);
     return 0;
 }
 
+/* Present the frame, or only prepare it, and swap the estimates taken from
+ * the credit for the bytes termbox encoded. A sprite that falls back to
+ * cells, or a repaint that finds a shorter way, sends something else */
+void
+present_frame(int prepare)
+{
+    size_t nbuf;
+
+    if (prepare)
+        tb_prepare();
+    else
+        tb_present();
+    if (g_state->budget && tb_present_size(&nbuf) == TB_OK)
+        g_state->credit += g_state->charged-(long)nbuf;
+    g_state->charged = 0;
+}
+
+/* Upper-left corner of the clock text in `font`, centered on the screen */
+Pos
+text_start(Font *font, int *textw)
+{
+    *textw = (font->w+1)*g_state->textlen-1;
+    return (Pos){
+        .x = g_state->center.x-*textw/2,
+        .y = g_state->center.y-font->h/2,
+    };
+}
+
+/* Bytes a full repaint in `font` sends besides the symbols: the sync
+ * markers around the frame, a screen clear, one attribute change, and a
+ * move and an erase for every row of the text. Termbox often finds
+ * something shorter, so this errs high */
+long
+repaint_cost(Font *font)
+{
+    Pos start;
+    int textw;
+    long row;
+
+    start = text_start(font, &textw);
+    row   = snprintf(NULL, 0, "\033[%d;%dH\033[%dX",
+            start.y+font->h, start.x+1, textw);
+    return strlen("\033[?2026h\033[?2026l\033[H\033[2J")
+        + strlen("\033[0;38;5;255;48;5;255m") + font->h*row;
+}
+
+/* Whether a full "88:88:88" in `font`, repaint included, takes more than a
+ * second's output */
 int
-draw_screen()
+too_costly(Font *font)
+{
+    const char *widest = "88:88:88.8";
+    struct tb_sprite *sprite;
+    size_t nbuf;
+    long cost;
+    int i;
+
+    if (!g_state->budget)
+        return 0;
+    cost = repaint_cost(font);
+    for (i = 0; i < g_state->textlen; i++)
+        if ((sprite = get_sprite(-1, widest[i], font))
+                && tb_sprite_size(sprite, &nbuf) == TB_OK)
+            cost += nbuf;
+    return cost > g_state->budget;
+}
+
+long long
+clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec*NS_PER_SEC+ts.tv_nsec;
+}
+
+/* Find the local zone's UTC offset at `t` and the time it changes next,
+ * so clock mode gets by with integer arithmetic and no localtime() per
+ * frame. A day is far shorter than any DST period, so probing daily and
+ * then bisecting down to the second can't miss a change */
+void
+load_zone(time_t t)
+{
+    struct tm tm;
+    time_t lo, hi, mid;
+    long off;
+
+    tzset();
+    localtime_r(&t, &tm);
+    off = tm.tm_gmtoff;
+
+    for (hi = t+86400; hi-t < ZONE_SCAN; hi += 86400) {
+        localtime_r(&hi, &tm);
+        if (tm.tm_gmtoff != off)
+            break;
+    }
+    if (hi-t < ZONE_SCAN) {
+        for (lo = hi-86400; hi-lo > 1;) {
+            mid = lo+(hi-lo)/2;
+            localtime_r(&mid, &tm);
+            if (tm.tm_gmtoff == off)
+                lo = mid;
+            else
+                hi = mid;
+        }
+    }
+
+    g_state->utcoff   = off;
+    g_state->tz_from  = t;
+    g_state->tz_until = hi;
+}
+
+void
+handle_hup(int sig)
 {
-    int i, blink, textw, stepx, startx, starty, symcount;
-    uintattr_t bgsave;
-    char text[9];
+    (void)sig;
+    g_reload_zone = 1;
+}
+
+/* Current tick, and nanoseconds into it if `ns` is given */
+long long
+tick_time(long long *ns)
+{
+    long long t;
+
+    t = clock_ns(g_state->clock)-g_state->phase;
+    if (ns)
+        *ns = t%g_state->tick_ns;
+    return t/g_state->tick_ns;
+}
+
+/* Render `curtime`. If `prepare` is set the frame is only encoded, and
+ * waits in termbox for the next tb_present. Returns 1 without touching
+ * termbox if the frame would look just like the last one */
+int
+draw_screen(int prepare)
+{
+    int i, pass, blink, full, textw, stepx, symcount;
+    char text[TEXT_MAX+1], shown[TEXT_MAX+1];
+    Frame *prev;
+    Font font;
+    Pos start;
 
     blink = 0;
     switch (g_state->mode) {
     case 'c':
-        struct tm *loctime;
+        time_t now;
+        long day; /* seconds into the local day */
 
-        loctime = localtime(&g_state->curtime);
-        strftime(text, sizeof(text), "%H:%M:%S", loctime);
+        now = g_state->curtime;
+        if (g_reload_zone) {
+            g_reload_zone     = 0;
+            g_state->tz_until = 0;
+        }
+        if (now < g_state->tz_from || now >= g_state->tz_until)
+            load_zone(now);
+        day = (now+g_state->utcoff)%86400;
+        day = day < 0? day+86400: day;
+        snprintf(text, sizeof(text), "%02u:%02u:%02u",
+                (unsigned)day/3600%24, (unsigned)day/60%60,
+                (unsigned)day%60);
         break;
     case 't':
-        int secs, mins, hours;
-
-        secs = difftime(g_state->endtime, g_state->curtime);
-        if (secs <= 0) {
-            blink = (g_state->curtime % 2 == 1);
-            secs  = 0;
+        long long left;
+        unsigned secs, mins, hours;
+
+        /* ticks end on the deadline, so a part tick left counts whole */
+        left = (g_state->endtime-g_state->curtime)*g_state->tick_ns;
+        if (left <= 0) {
+            blink = (-left/NS_PER_SEC % 2 == 1);
+            left  = 0;
         }
+        secs  = left/NS_PER_SEC;
         mins  = secs/60;
         hours = mins/60;
-        snprintf(text, sizeof(text),
-                "%02d:%02d:%02d", hours%100, mins%60, secs%60);
+        snprintf(text, sizeof(text), "%02u:%02u:%02u.%u",
+                hours%100, mins%60, secs%60, (unsigned)(left/100000000LL%10));
+        text[g_state->textlen] = '\0';
         break;
     default:
         die("[ERROR] unknown mode");
     }
 
-    symcount = sizeof(text)-1;
-    stepx    = g_state->font.w+1;
-    textw    = stepx*symcount-1;
-    startx   = g_state->center.x-textw/2;
-    starty   = g_state->center.y-g_state->font.h/2;
-    bgsave   = g_state->font.bg;
+    symcount = g_state->textlen;
+    font     = g_state->font;
+    font.bg  = blink? TEXT_BLINK_COLOR: font.bg;
+    stepx    = font.w+1;
+    start    = text_start(&font, &textw);
+
+    /* repaint everything only if the layout or the look has changed,
+     * otherwise touch just the symbols that differ from the last frame */
+    prev = &g_state->frame;
+    full = !prev->valid || prev->blink != blink
+        || !font_equal(&prev->font, &font)
+        || prev->start.x != start.x || prev->start.y != start.y;
+    if (!full && !memcmp(prev->text, text, symcount))
+        return 1;
 
     /* clear internal buffer */
-    tb_clear();
-
-    /* drawing */
-    for (i = 0; i < symcount; ++i) {
-        Pos pos;
-
-        g_state->font.bg = blink? TEXT_BLINK_COLOR: bgsave;
-        pos              = (Pos){ .x = startx+i*stepx, .y = starty };
-
-        if (draw_symbol(text[i], &pos, &g_state->font) < 0)
-            return g_last_errno;
+    if (full) {
+        tb_clear();
+        memset(shown, ' ', symcount);
+    } else {
+        memcpy(shown, prev->text, symcount);
+    }
+    shown[symcount] = '\0';
+
+    /* drawing, digits from the most significant one and the separators
+     * last, for as long as the output budget lasts. Symbols left out keep
+     * showing what they did and catch up on later frames */
+    refill_credit();
+    if (full && g_state->budget)
+        take_credit(repaint_cost(&font));
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < symcount; ++i) {
+            Pos pos;
+            int from;
+
+            if (shown[i] == text[i]
+                    || (pass == 0) != !!isdigit((unsigned char)text[i]))
+                continue;
+
+            from = full? -1: shown[i];
+            if (spend_credit(from, text[i], &font) < 0)
+                goto present;
+
+            pos = (Pos){ .x = start.x+i*stepx, .y = start.y };
+
+            if (draw_symbol(from, text[i], &pos, &font) < 0) {
+                prev->valid = 0;
+                return g_last_errno;
+            }
+            shown[i] = text[i];
+        }
     }
 
+present:
     /* sync internal buffer and terminal */
-    tb_present();
-
-    g_state->font.bg = bgsave;
+    present_frame(prepare);
+
+    *prev = (Frame){
+        .valid = 1,
+        .blink = blink,
+        .font  = font,
+        .start = start,
+    };
+    memcpy(prev->text, shown, sizeof(prev->text));
     return 0;
 }
 
 void
 update_sizes()
 {
-    int w, h;
+    int w, h, textw;
+    Font large;
+    Pos start;
 
     w               = tb_width();
     h               = tb_height();
     g_state->center = (Pos){ .x = w/2, .y = h/2 };
-
-    if (w < FONT_CHANGE_WIDTH)
+    g_state->frame.valid = 0;
+    g_state->held        = 0; /* termbox drops it on resize */
+
+    large = (Font){
+        .glyphs = g_glyphs_large,
+        .sx     = PIXELS_PER_CELL == 4? 2: 1,
+        .sy     = PIXELS_PER_CELL >= 2? 2: 1,
+        .fg     = g_state->font.fg,
+        .bg     = g_state->font.bg,
+    };
+    large.w = (LARGE_FONT_WIDTH+large.sx-1)/large.sx;
+    large.h = (LARGE_FONT_HEIGHT+large.sy-1)/large.sy;
+    /* a slow line gets the small font even on a wide terminal */
+    if (w < FONT_CHANGE_WIDTH*g_state->textlen/TEXT_LEN/large.sx
+            || too_costly(&large))
         g_state->font = (Font){
-            .data = (void *)g_font_small,
-            .w    = SMALL_FONT_WIDTH,
-            .h    = SMALL_FONT_HEIGHT,
-            .fg   = g_state->font.fg,
-            .bg   = g_state->font.bg,
+            .glyphs = g_glyphs_small,
+            .w      = SMALL_FONT_WIDTH,
+            .h      = SMALL_FONT_HEIGHT,
+            .sx     = 1,
+            .sy     = 1,
+            .fg     = g_state->font.fg,
+            .bg     = g_state->font.bg,
         };
     else
-        g_state->font = (Font){
-            .data = (void *)g_font_large,
-            .w    = LARGE_FONT_WIDTH,
-            .h    = LARGE_FONT_HEIGHT,
-            .fg   = g_state->font.fg,
-            .bg   = g_state->font.bg,
-        };
+        g_state->font = large;
+
+    /* nothing is ever drawn outside the text, so termbox can skip the rest */
+    start = text_start(&g_state->font, &textw);
+    tb_set_viewport(start.x, start.y, textw, g_state->font.h);
 }
 
+/* Wait for an event until tick time `at`, in nanoseconds */
 int
-handle_event()
+handle_event(long long at)
 {
     struct tb_event ev;
+    struct timespec wake;
 
-    tb_peek_event(&ev, MS_PER_FRAME);
+    at  += g_state->phase;
+    wake = (struct timespec){
+        .tv_sec = at/NS_PER_SEC, .tv_nsec = at%NS_PER_SEC,
+    };
+    /* with SIGHUP handled, a hung up terminal shows as a failing read */
+    if (tb_peek_event_until(&ev, g_state->clock, &wake) == TB_ERR_READ)
+        return 0;
 
     switch (ev.type) {
     case TB_EVENT_KEY:
@@ -225,18 +675,61 @@ handle_event()
 void
 tui_loop()
 {
+    compile_fonts();
     tb_init();
+    tb_set_present_mode(TB_PRESENT_RLE | TB_PRESENT_SYNC
+            | TB_PRESENT_NONBLOCK | TB_PRESENT_KEEP);
+    g_state->budget = line_budget();
+    g_state->credit = g_state->budget;
+    clock_gettime(CLOCK_MONOTONIC, &g_state->refilled);
     update_sizes();
     while (1) {
-        g_state->curtime = time(NULL);
+        long long now, ns, wake;
+        int rv;
+
+        now = tick_time(NULL);
         if (g_state->mode == 't' && g_state->autoexit
-                && g_state->curtime >= g_state->endtime)
+                && now >= g_state->endtime)
+            break;
+
+        /* the frame for this tick was rendered ahead of time and only
+         * needs writing, unless a resize or a late wakeup spoiled it */
+        if (g_state->frame.valid && g_state->ready == now) {
+            if (g_state->held)
+                present_frame(0);
+            g_state->ready = 0;
+        } else if (!g_state->frame.valid || (g_state->ready
+                    ? g_state->ready != now+1: g_state->curtime != now)) {
+            /* a frame held for a tick already gone goes out first. The
+             * last frame is the one it holds, and this tick may well look
+             * the same and draw nothing */
+            if (g_state->ready && g_state->held)
+                present_frame(0);
+            g_state->ready   = 0;
+            g_state->curtime = now;
+            if (draw_screen(0) < 0) break;
+        }
+
+        /* get the next tick ready shortly before it starts. Not any
+         * earlier, as a resize throws the prepared frame away */
+        now = tick_time(&ns);
+        if (!g_state->ready && ns >= g_state->tick_ns-PREPARE_NS) {
+            g_state->curtime = now+1;
+            if ((rv = draw_screen(1)) < 0) break;
+            g_state->held  = (rv == 0);
+            g_state->ready = now+1;
+        }
+
+        /* sleep until the very start of the next tick, or until it is
+         * time to prepare it, but never longer than a frame */
+        wake = (now+1)*g_state->tick_ns-(g_state->ready? 0: PREPARE_NS);
+        ns  += now*g_state->tick_ns+(MS_PER_FRAME)*1000000LL;
+        if (handle_event(wake < ns? wake: ns) <= 0)
             break;
-        if (draw_screen() < 0)      break;
-        if (handle_event() <= 0)    break;
         if (check_terminal() < 0)   break;
     }
     tb_shutdown();
+    free_sprites();
 }
 
 void
@@ -261,6 +754,7 @@ int
 main(int argc, char *argv[])
 {
     int autoexit, startmode, timertime;
+    long long deadline;
 
     autoexit = AUTO_EXIT;
 
@@ -331,9 +825,35 @@ main(int argc, char *argv[])
 
     g_state->mode      = startmode;
     g_state->autoexit  = autoexit;
-    g_state->starttime = time(NULL);
-    g_state->endtime   = g_state->starttime + timertime;
+    g_state->textlen   = TEXT_LEN;
+    g_state->clock     = CLOCK_REALTIME;
+    g_state->tick_ns   = NS_PER_SEC;
+    g_state->phase     = 0;
+    g_state->endtime   = 0;
+    if (startmode == 't') {
+        /* a countdown mustn't move with clock changes, and its ticks
+         * start from the deadline so expiry falls right on one */
+        g_state->textlen = TIMER_TENTHS? TEXT_MAX: TEXT_LEN;
+        g_state->clock   = CLOCK_MONOTONIC;
+        g_state->tick_ns = TIMER_TENTHS? NS_PER_SEC/10: NS_PER_SEC;
+        deadline         = clock_ns(CLOCK_MONOTONIC)+timertime*NS_PER_SEC;
+        g_state->phase   = deadline%g_state->tick_ns;
+        g_state->endtime = deadline/g_state->tick_ns;
+    }
     g_state->font      = (Font){ .fg = TEXT_COLOR, .bg = TEXT_COLOR };
+    g_state->frame     = (Frame){ .valid = 0 };
+    g_state->ready     = 0;
+    g_state->held      = 0;
+    g_state->tz_from   = 0;
+    g_state->tz_until  = 0;
+    if (startmode == 'c') {
+        struct sigaction sa;
+
+        /* SIGHUP makes the clock pick up a changed TZ or zone file */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_hup;
+        sigaction(SIGHUP, &sa, NULL);
+    }
 
     tui_loop();
 
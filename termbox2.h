@@ -49,6 +49,7 @@ SOFTWARE.
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
@@ -92,6 +93,29 @@ extern "C" {
  *                    libc's are locale-dependent and the caller must
  *                    `setlocale(3)` `LC_CTYPE` to UTF-8. Defaults to built-in.
  *
+ *    TB_OPT_THREADS: If set to a number above 1, `tb_present` diffs and
+ *                    encodes bands of rows on that many threads, the caller
+ *                    included, for very large terminals. Bands after the
+ *                    first cannot know where the one before leaves the
+ *                    cursor, so their first changed rows are encoded again
+ *                    once it is known and the output is byte for byte what
+ *                    a single thread sends. Requires linking with
+ *                    `-pthread`. Defaults off.
+ *
+ * TB_OPT_THREADS_CHECK: If set with `TB_OPT_THREADS`, every `tb_present`
+ *                    also encodes the frame on one thread and aborts if the
+ *                    bands put together send anything else. Slow, for
+ *                    testing. Defaults off.
+ *
+ *      TB_OPT_EPOLL: If set, wait for events on a persistent `epoll(7)`
+ *                    instance, with `timerfd_create(2)` timers for absolute
+ *                    deadlines, instead of rebuilding `select(2)` fd sets on
+ *                    every wait. Falls back to `select` for fds epoll can't
+ *                    watch. Linux only. Defaults off.
+ *
+ *  TB_OPT_EXTRA_FDS: Max number of caller fds `tb_add_fd` can watch.
+ *                    Defaults to 8.
+ *
  *  TB_OPT_TRUECOLOR: Deprecated. Sets TB_OPT_ATTR_W to 32 if not already set.
  */
 
@@ -248,6 +272,9 @@ extern "C" {
 #define TB_HARDCAP_STRIKEOUT    "\x1b[9m"
 #define TB_HARDCAP_UNDERLINE_2  "\x1b[21m"
 #define TB_HARDCAP_OVERLINE     "\x1b[53m"
+#define TB_HARDCAP_QUERY_SYNC   "\x1b[?2026$p"
+#define TB_HARDCAP_BEGIN_SYNC   "\x1b[?2026h"
+#define TB_HARDCAP_END_SYNC     "\x1b[?2026l"
 
 /* Colors (numeric) and attributes (bitwise) (`tb_cell.fg`, `tb_cell.bg`) */
 #define TB_DEFAULT              0x0000
@@ -299,6 +326,7 @@ extern "C" {
 #define TB_EVENT_KEY        1
 #define TB_EVENT_RESIZE     2
 #define TB_EVENT_MOUSE      3
+#define TB_EVENT_FD         4
 
 /* Key modifiers (bitwise) (`tb_event.mod`) */
 #define TB_MOD_ALT          1
@@ -322,6 +350,14 @@ extern "C" {
 #define TB_OUTPUT_TRUECOLOR 5
 #endif
 
+/* Present modes (bitwise) */
+#define TB_PRESENT_CURRENT  0
+#define TB_PRESENT_NORMAL   1
+#define TB_PRESENT_RLE      2
+#define TB_PRESENT_SYNC     4
+#define TB_PRESENT_NONBLOCK 8
+#define TB_PRESENT_KEEP     16
+
 /* Common function return values unless otherwise noted.
  *
  * Library behavior is undefined after receiving `TB_ERR_MEM`. Callers may
@@ -373,6 +409,11 @@ extern "C" {
 #define TB_OPT_READ_BUF 64
 #endif
 
+/* Define this to set how many caller fds `tb_add_fd` can watch */
+#ifndef TB_OPT_EXTRA_FDS
+#define TB_OPT_EXTRA_FDS 8
+#endif
+
 /* Define this for limited back compat with termbox v1 */
 #ifdef TB_OPT_V1_COMPAT
 #define tb_change_cell          tb_set_cell
@@ -445,6 +486,8 @@ struct tb_cell {
  * when `TB_EVENT_RESIZE`: `w` and `h`
  *
  *  when `TB_EVENT_MOUSE`: `key` (`TB_KEY_MOUSE_*`), `x`, and `y`
+ *
+ *     when `TB_EVENT_FD`: `fd`
  */
 struct tb_event {
     uint8_t type; // one of `TB_EVENT_*` constants
@@ -455,6 +498,7 @@ struct tb_event {
     int32_t h;    // resize height
     int32_t x;    // mouse x
     int32_t y;    // mouse y
+    int32_t fd;   // readable fd from `tb_add_fd`
 };
 
 /* Initialize the termbox library. This function should be called before any
@@ -467,10 +511,11 @@ int tb_init_fd(int ttyfd);
 int tb_init_rwfd(int rfd, int wfd);
 int tb_shutdown(void);
 
-/* Return the size of the internal back buffer (which is the same as terminal's
- * window size in rows and columns). The internal buffer can be resized after
- * `tb_clear` or `tb_present` calls. Both dimensions have an unspecified
- * negative value when called before `tb_init` or after `tb_shutdown`.
+/* Return the terminal's window size in rows and columns, which is also the
+ * size of the internal back buffer unless `tb_set_viewport` limits it. The
+ * internal buffer can be resized after `tb_clear` or `tb_present` calls. Both
+ * dimensions have an unspecified negative value when called before `tb_init`
+ * or after `tb_shutdown`.
  */
 int tb_width(void);
 int tb_height(void);
@@ -481,15 +526,42 @@ int tb_height(void);
 int tb_clear(void);
 int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg);
 
-/* Synchronize the internal back buffer with the terminal by writing to tty. */
+/* Synchronize the internal back buffer with the terminal by writing to tty.
+ * Only the columns written since the previous call are compared with the front
+ * buffer, so the cost scales with what changed rather than with screen size.
+ */
 int tb_present(void);
 
+/* Encode the changes like `tb_present`, but hold the bytes instead of writing
+ * them, so that the next `tb_present` only has to write. Cells changed in
+ * between are sent along with them. A resize drops a held frame and has the
+ * next present clear the screen, and functions that write to the tty
+ * themselves send it early.
+ */
+int tb_prepare(void);
+
+/* Store in `nbuf` how many bytes the last `tb_present` or `tb_prepare` added
+ * to the output, blitted sprites and synchronized update markers included.
+ * Changes a non-blocking present leaves for later are counted by the present
+ * that sends them. For callers that budget their output.
+ */
+int tb_present_size(size_t *nbuf);
+
 /* Clear the internal front buffer effectively forcing a complete re-render of
  * the back buffer to the tty. It is not necessary to call this under normal
  * circumstances.
  */
 int tb_invalidate(void);
 
+/* Limit the internal buffers to a rectangle of the screen, for applications
+ * that only draw there. Positions stay relative to the whole screen, but
+ * cells outside the rectangle can't be set (`TB_ERR_OUT_OF_BOUNDS`) and are
+ * left blank. The rectangle is clipped to the screen, also after a resize.
+ * Changing it clears the screen, unless `TB_PRESENT_KEEP` is set. A `w` or `h`
+ * of 0 or less, or a rectangle entirely off screen, restores the whole screen.
+ */
+int tb_set_viewport(int x, int y, int w, int h);
+
 /* Set the position of the cursor. Upper-left cell is (0, 0). */
 int tb_set_cursor(int cx, int cy);
 int tb_hide_cursor(void);
@@ -520,7 +592,8 @@ int tb_extend_cell(int x, int y, uint32_t ch);
  *
  * Callers may use pointer math to access cells relative to the requested one.
  * The cell grid memory layout is a contiguous array indexable by the expression
- * `(y * width) + x`.
+ * `(y * width) + x`, relative to the viewport if one is set (see
+ * `tb_set_viewport`).
  *
  * If `back` is non-zero, return cell from the internal back buffer. Otherwise,
  * return cell from the front buffer. Note the front buffer is updated on each
@@ -531,6 +604,49 @@ int tb_extend_cell(int x, int y, uint32_t ch);
  */
 int tb_get_cell(int x, int y, int back, struct tb_cell **cell);
 
+/* A block of cells whose terminal output is encoded once and then replayed
+ * wherever the block is placed. Fields are internal, treat as opaque.
+ */
+struct tb_sprite {
+    int w;
+    int h;
+    struct tb_cell *cells; // private copy of the block, row-major
+    char *buf;             // encoded output, moving the cursor relatively
+    size_t nbuf;
+    int start_x;           // first cell drawn by `buf`, relative to the block
+    int start_y;
+    int end_x;             // cursor after `buf`, relative to the block
+    int end_y;
+    uintattr_t end_fg;     // attributes in effect after `buf`
+    uintattr_t end_bg;
+    int output_mode;       // modes `buf` was encoded for, 0 when stale
+    int present_mode;
+};
+
+/* Initialize a sprite from `w * h` row-major cells. Cells with a zero `ch`
+ * are transparent and leave whatever is below them alone. Only single-width
+ * codepoints without grapheme clusters are accepted, otherwise `TB_ERR` is
+ * returned.
+ *
+ * `tb_sprite_blit` writes the sprite with its top-left corner at `x, y`. Its
+ * pre-encoded output is appended as is, skipping the usual diff of
+ * `tb_present`, and both the back and the front buffer are updated to match.
+ * Output is re-encoded on the first blit after the output or present mode
+ * changed. A sprite that would touch the last column or fall outside the
+ * screen is instead set cell by cell, clipped, and diffed by the next
+ * `tb_present` as usual. Either way the bytes go out with the next
+ * `tb_present`.
+ *
+ * `tb_sprite_size` stores in `nbuf` how many bytes a blit appends, not
+ * counting the move to the sprite, for callers that budget their output.
+ *
+ * `tb_sprite_free` releases the memory held by a sprite.
+ */
+int tb_sprite_init(struct tb_sprite *sp, int w, int h, struct tb_cell *cells);
+int tb_sprite_blit(struct tb_sprite *sp, int x, int y);
+int tb_sprite_size(struct tb_sprite *sp, size_t *nbuf);
+int tb_sprite_free(struct tb_sprite *sp);
+
 /* Set the input mode. Termbox has two input modes:
  *
  * 1. `TB_INPUT_ESC`
@@ -647,6 +763,53 @@ int tb_set_input_mode(int mode);
  */
 int tb_set_output_mode(int mode);
 
+/* Set the present mode, which controls how `tb_present` encodes changed cells.
+ *
+ * 1. `TB_PRESENT_NORMAL`
+ *    Every changed cell is sent as its own character.
+ *
+ * 2. `TB_PRESENT_RLE`
+ *    Runs of identical changed cells on a row are sent as a single erase
+ *    (`ECH`, or `EL` when the run reaches the end of the line) or as one
+ *    character followed by a repeat (`REP`), whichever takes the fewest bytes.
+ *    Sequences the terminal does not advertise are never used, and erases are
+ *    only used for plain spaces whose background the terminal can reproduce,
+ *    so a run falls back to plain characters when nothing else is shorter.
+ *
+ * 3. `TB_PRESENT_SYNC`
+ *    Each present is wrapped in begin/end synchronized update markers (DEC
+ *    private mode 2026) so the terminal draws the whole frame at once. Setting
+ *    this mode asks the terminal whether it supports them. The answer arrives
+ *    as input and is consumed by `tb_peek_event` or `tb_poll_event`; until a
+ *    supporting answer is seen, presents are sent unwrapped.
+ *
+ * 4. `TB_PRESENT_NONBLOCK`
+ *    Output is written without blocking. Bytes the terminal can't take yet
+ *    are kept and sent as it drains, by `tb_peek_event` or `tb_poll_event`
+ *    while waiting, or by the next `tb_present`. While a previous frame is
+ *    still queued, `tb_present` returns `TB_OK` without sending anything and
+ *    the changes stay pending, so a stalled link only ever receives the
+ *    latest state once it recovers.
+ *
+ * 5. `TB_PRESENT_KEEP`
+ *    Viewport changes and resizes that grow the screen don't clear it. The
+ *    front buffer keeps whatever the terminal still shows, so the next
+ *    present sends only cells that differ and erases the ones left outside
+ *    the buffers. If the viewport moved without changing size, its old
+ *    contents may instead be shifted into place with insert/delete line and
+ *    character sequences. The screen is still cleared when that sends less,
+ *    and always when it shrinks, since output written for the old size may
+ *    have wrapped or scrolled it.
+ *
+ * `TB_PRESENT_NORMAL` is implied and may be omitted. Other modes may be
+ * combined via bitwise OR.
+ *
+ * If mode is `TB_PRESENT_CURRENT`, return the current present mode.
+ *
+ * The default present mode is `TB_PRESENT_NORMAL`.
+ */
+int tb_set_present_mode(int mode);
+
 /* Wait for an event up to `timeout_ms` milliseconds and populate `event` with
  * it. If no event is available within the timeout period, `TB_ERR_NO_EVENT`
  * is returned. On a resize event, the underlying `select(2)` call may be
@@ -659,6 +822,25 @@ int tb_peek_event(struct tb_event *event, int timeout_ms);
 /* Same as `tb_peek_event` except no timeout. */
 int tb_poll_event(struct tb_event *event);
 
+/* Same as `tb_peek_event` except the wait ends at `deadline`, an absolute
+ * time on `clock` (`CLOCK_REALTIME` or `CLOCK_MONOTONIC`), to the
+ * microsecond. Use it to wake up right on a wall-clock boundary or a
+ * countdown's expiry; a relative millisecond timeout drifts with however
+ * long the caller took since it read the clock.
+ */
+int tb_peek_event_until(struct tb_event *event, clockid_t clock,
+    const struct timespec *deadline);
+
+/* Watch `fd` for input alongside the tty, e.g. a control socket or a child
+ * process's pipe. While it's readable, `tb_peek_event` and `tb_poll_event`
+ * return a `TB_EVENT_FD` event for it, after any pending key or resize
+ * events; the caller does the reading. Up to `TB_OPT_EXTRA_FDS` fds may be
+ * watched. `tb_del_fd` stops watching `fd`, and must be called before
+ * closing it.
+ */
+int tb_add_fd(int fd);
+int tb_del_fd(int fd);
+
 /* Internal termbox fds that can be used with `poll(2)`, `select(2)`, etc.
  * externally. Callers must invoke `tb_poll_event` or `tb_peek_event` if
  * fds become readable.
@@ -762,6 +944,24 @@ int tb_wcwidth(uint32_t ch);
 
 #ifdef TB_IMPL
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef TB_OPT_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#ifdef TB_OPT_THREADS
+#include <pthread.h>
+#define TB_THREAD_LOCAL __thread
+#else
+#define TB_THREAD_LOCAL
+#endif
+
 #define if_err_return(rv, expr)                                                \
     if (((rv) = (expr)) != TB_OK) return (rv)
 #define if_err_break(rv, expr)                                                 \
@@ -772,11 +972,9 @@ int tb_wcwidth(uint32_t ch);
     if (((rv) = (expr)) == TB_OK || (rv) == TB_ERR_NEED_MORE) return (rv)
 
 #define send_literal(rv, a)                                                    \
-    if_err_return((rv), bytebuf_nputs(&global.out, (a), sizeof(a) - 1))
+    if_err_return((rv), bytebuf_nputs(&enc->out, (a), sizeof(a) - 1))
 
-#define send_num(rv, nbuf, n)                                                  \
-    if_err_return((rv),                                                        \
-        bytebuf_nputs(&global.out, (nbuf), convert_num((n), (nbuf))))
+#define send_num(rv, n) if_err_return((rv), send_number(n))
 
 #define snprintf_or_return(rv, str, sz, fmt, ...)                              \
     do {                                                                       \
@@ -787,16 +985,86 @@ int tb_wcwidth(uint32_t ch);
 #define if_not_init_return()                                                   \
     if (!global.initialized) return TB_ERR_NOT_INIT
 
+// Extended terminal capabilities, only used to improve output
+#define TB_EXTCAP_ECH 0x01 // erase characters, `CSI n X`
+#define TB_EXTCAP_REP 0x02 // repeat preceding character, `CSI n b`
+#define TB_EXTCAP_EL  0x04 // erase to end of line, `CSI K`
+#define TB_EXTCAP_BCE 0x08 // erased cells take the current background
+#define TB_EXTCAP_SYNC 0x10 // synchronized output, DEC mode 2026
+#define TB_EXTCAP_IL  0x20 // insert lines, `CSI n L`
+#define TB_EXTCAP_DL  0x40 // delete lines, `CSI n M`
+#define TB_EXTCAP_ICH 0x80 // insert characters, `CSI n @`
+#define TB_EXTCAP_DCH 0x100 // delete characters, `CSI n P`
+#define TB_EXTCAP_EDIT                                                         \
+    (TB_EXTCAP_IL | TB_EXTCAP_DL | TB_EXTCAP_ICH | TB_EXTCAP_DCH)
+
+// Ways to send a run of identical cells (see `pick_run`)
+#define TB_RUN_PLAIN 0 // every cell as a character
+#define TB_RUN_REP   1 // one character, then repeat it
+#define TB_RUN_ECH   2 // erase the cells in place
+#define TB_RUN_EL    3 // erase to the end of the line
+
+// Ways to move the cursor (see `move_cost`)
+#define TB_MOVE_CUP 0 // absolute position
+#define TB_MOVE_REL 1 // relative moves from the current position
+#define TB_MOVE_CR  2 // carriage return, then relative moves
+
+// Longest gap worth stepping over by printing its cells again
+#define TB_REPRINT_MAX 8
+
+// Rows per band of a threaded `tb_present`
+#define TB_BAND_ROWS 16
+
+// Style attributes that make a space look different from an erased cell
+#if TB_OPT_ATTR_W == 64
+#define TB_STYLE_MASK                                                          \
+    (TB_BOLD | TB_UNDERLINE | TB_REVERSE | TB_ITALIC | TB_BLINK | TB_DIM |     \
+        TB_STRIKEOUT | TB_UNDERLINE_2 | TB_OVERLINE | TB_INVISIBLE)
+#else
+#define TB_STYLE_MASK                                                          \
+    (TB_BOLD | TB_UNDERLINE | TB_REVERSE | TB_ITALIC | TB_BLINK | TB_DIM)
+#endif
+
 struct bytebuf {
     char *buf;
     size_t len;
     size_t cap;
 };
 
+// Columns `[x0, x1)` of a row written since the last `tb_present`. The span
+// is empty when `x0 >= x1`. Rows that hold a cell wider than one column are
+// scanned from the start so `tb_present` stays aligned to cell boundaries.
+struct cellbuf_row {
+    int x0;
+    int x1;
+    int has_wide;
+    int has_ech; // some cell in the row owns a grapheme cluster buffer
+};
+
 struct cellbuf {
     int width;
     int height;
     struct tb_cell *cells;
+    struct cellbuf_row *rows;
+    int cap;      // cells allocated, may exceed `width * height`
+    int rows_cap; // rows allocated, may exceed `height`
+};
+
+struct numstr {
+    char buf[15];
+    unsigned char len;
+};
+
+// Escape sequence pieces formatted ahead of time, so that sending a number
+// or a cursor position is a copy. Tables only grow, since an entry does not
+// depend on the geometry.
+struct numtab {
+    struct numstr *nums;     // "n" for `0 <= n < nnums`
+    struct numstr *cup_rows; // "\x1b[y;" for each row, 1-based
+    struct numstr *cup_cols; // "xH" for each column, 1-based
+    int nnums;
+    int nrows;
+    int ncols;
 };
 
 struct cap_trie {
@@ -808,6 +1076,69 @@ struct cap_trie {
     uint8_t mod;
 };
 
+// Output and what the terminal is known to show once it is written. Bands
+// of a threaded `tb_present` each have their own.
+struct encoder {
+    struct bytebuf out;
+    int last_x;
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    int attr_known; // last_fg/last_bg are what the terminal shows
+};
+
+#ifdef TB_OPT_THREADS
+// A row of a band: where its bytes start in the band's output, the encoder
+// state they were encoded from, and the row as it was before, so it can be
+// encoded again from the state the band before actually leaves
+struct band_row {
+    size_t off;
+    int last_x;
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    int attr_known;
+    struct cellbuf_row back;
+    struct cellbuf_row front;
+    int saved_x; // first front cell saved, -1 if the row had no changes
+};
+
+struct band {
+    struct encoder enc;
+    struct band_row rows[TB_BAND_ROWS];
+    struct tb_cell *saved; // front cells of the rows, `TB_BAND_ROWS` wide rows
+    int saved_cap;
+};
+
+// Threads encoding the bands of a `tb_present`. Each present bumps `gen`,
+// then the caller and the workers take bands in turn until none are left.
+struct workpool {
+    pthread_t threads[TB_OPT_THREADS];
+    int nthreads; // workers started, may be fewer than asked for
+    int started;  // lock and conditions are initialized
+    pthread_mutex_t lock;
+    pthread_cond_t work; // a new present to help with, or quit
+    pthread_cond_t done; // the last band is encoded
+    unsigned gen;
+    int quit;
+    struct band *bands;
+    int bands_cap;
+    int nbands; // bands of the current present
+    int next;   // next band to take
+    int ndone;
+    int rv; // error from any band, else `TB_OK`
+};
+#endif
+
+// Fds found ready by `wait_fds`
+struct wait_ready {
+    int tty;
+    int resize;
+    int out;     // `wfd` can take more of `out_pending`
+    int fd;      // a readable fd from `tb_add_fd`, else -1
+    int timeout; // the deadline has passed
+};
+
 struct tb_global {
     int ttyfd;
     int rfd;
@@ -818,22 +1149,54 @@ struct tb_global {
     int height;
     int cursor_x;
     int cursor_y;
-    int last_x;
-    int last_y;
     uintattr_t fg;
     uintattr_t bg;
-    uintattr_t last_fg;
-    uintattr_t last_bg;
+    uintattr_t sgr_attrs;  // attributes for delta SGR, 0 if unsupported
     int input_mode;
     int output_mode;
+    int present_mode;
+    int extcaps;
+    int sync_queried;
+    int view_x; // rectangle asked for by `tb_set_viewport`, whole screen if
+    int view_y; // `view_w` or `view_h` is 0
+    int view_w;
+    int view_h;
+    int buf_x;  // screen position of the cell buffers' top left cell
+    int buf_y;
+    struct cellbuf shown; // screen contents from before a `TB_PRESENT_KEEP`
+    int shown_valid;      // resize, until the next present sorts them out
+    int shown_x;          // screen position of `shown`
+    int shown_y;
+    int shown_w; // screen size when `shown` was taken
+    int shown_h;
+    int fit_w;   // screen size the cell buffers were last fitted to
+    int fit_h;
+    int wfd_flags;      // original flags of wfd while non-blocking, else -1
+    size_t out_pending; // bytes of `out` left over from the last flush
+    int out_held;       // `out` holds a frame from `tb_prepare`
+    size_t out_old;     // bytes of `out` counted by an earlier present
+    size_t out_frame;   // bytes the last present or prepare added
+    int extra_fds[TB_OPT_EXTRA_FDS]; // caller fds from `tb_add_fd`
+    int nextra_fds;
+#ifdef TB_OPT_EPOLL
+    int epfd;       // persistent epoll instance, -1 to use `select` instead
+    int epoll_out;  // whether epoll watches `wfd` for writability
+    int timerfd[2]; // deadline timers on `CLOCK_MONOTONIC` and `_REALTIME`
+    int timer_armed[2];          // whether `timer_at` is still in effect
+    struct timespec timer_at[2]; // deadline each timer was last armed for
+#endif
     char *terminfo;
     size_t nterminfo;
     const char *caps[TB_CAP__COUNT];
     struct cap_trie cap_trie;
     struct bytebuf in;
-    struct bytebuf out;
+    struct encoder enc;
     struct cellbuf back;
     struct cellbuf front;
+    struct numtab numtab;
+#ifdef TB_OPT_THREADS
+    struct workpool pool;
+#endif
     struct termios orig_tios;
     int has_orig_tios;
     int last_errno;
@@ -845,6 +1208,10 @@ struct tb_global {
 
 static struct tb_global global = {0};
 
+// The encoder output goes to, `global.enc` except in a band of a threaded
+// `tb_present`
+static TB_THREAD_LOCAL struct encoder *enc = &global.enc;
+
 /* BEGIN codegen c */
 /* Produced by ./codegen.sh on Tue, 03 Sep 2024 04:17:48 +0000 */
 
@@ -1157,6 +1524,17 @@ static struct {
 
 /* END codegen c */
 
+// `TB_EXTCAP_*` of the builtin terms, in `builtin_terms` order
+static const int builtin_terms_extcaps[] = {
+    TB_EXTCAP_ECH | TB_EXTCAP_REP | TB_EXTCAP_EL | TB_EXTCAP_BCE |
+        TB_EXTCAP_EDIT,                                           // xterm
+    TB_EXTCAP_ECH | TB_EXTCAP_EL | TB_EXTCAP_BCE | TB_EXTCAP_EDIT, // linux
+    TB_EXTCAP_ECH | TB_EXTCAP_EL | TB_EXTCAP_EDIT,                 // screen
+    TB_EXTCAP_ECH | TB_EXTCAP_EL | TB_EXTCAP_BCE | TB_EXTCAP_EDIT, // rxvt-256color
+    TB_EXTCAP_ECH | TB_EXTCAP_EL | TB_EXTCAP_BCE | TB_EXTCAP_EDIT, // rxvt-unicode
+    TB_EXTCAP_ECH | TB_EXTCAP_EL,                 // Eterm
+};
+
 static struct {
     const char *cap;
     const uint16_t key;
@@ -2275,14 +2653,24 @@ static int tb_printf_inner(int x, int y, uintattr_t fg, uintattr_t bg,
     size_t *out_w, const char *fmt, va_list vl);
 static int init_term_attrs(void);
 static int init_term_caps(void);
+static int init_sgr_delta(void);
 static int init_cap_trie(void);
 static int cap_trie_add(const char *cap, uint16_t key, uint8_t mod);
 static int cap_trie_find(const char *buf, size_t nbuf, struct cap_trie **last,
     size_t *depth);
 static int cap_trie_deinit(struct cap_trie *node);
 static int init_resize_handler(void);
+#ifdef TB_OPT_EPOLL
+static int init_epoll(void);
+static int epoll_watch(int op, int fd, uint32_t events);
+static int epoll_watch_out(int on);
+static int arm_timer(int t, const struct timespec *deadline);
+static int wait_fds_epoll(clockid_t clock, const struct timespec *deadline,
+    struct wait_ready *ready);
+#endif
 static int send_init_escape_codes(void);
 static int send_clear(void);
+static int queue_clear(void);
 static int update_term_size(void);
 static int update_term_size_via_esc(void);
 static int init_cellbuf(void);
@@ -2295,22 +2683,80 @@ static int load_builtin_caps(void);
 static const char *get_terminfo_string(int16_t offsets_pos, int16_t offsets_len,
     int16_t table_pos, int16_t table_size, int16_t index);
 static int get_terminfo_int16(int offset, int16_t *val);
-static int wait_event(struct tb_event *event, int timeout);
+static int wait_event(struct tb_event *event, clockid_t clock,
+    const struct timespec *deadline);
+static int wait_fds(clockid_t clock, const struct timespec *deadline,
+    struct wait_ready *ready);
+static int wait_fds_select(clockid_t clock, const struct timespec *deadline,
+    struct wait_ready *ready);
 static int extract_event(struct tb_event *event);
 static int extract_esc(struct tb_event *event);
 static int extract_esc_user(struct tb_event *event, int is_post);
 static int extract_esc_cap(struct tb_event *event);
 static int extract_esc_mouse(struct tb_event *event);
-static int resize_cellbufs(void);
+static int extract_esc_mode_report(struct tb_event *event);
+static int resize_cellbufs(int keep);
+static int keep_cellbufs(void);
+static struct tb_cell *shown_cell_at(int x, int y);
+static int present_shown(void);
+static int shift_cost(int dx, int dy);
+static int send_shift(int dx, int dy);
+static int stale_run(int x, int y, int x1);
+static int count_stale_shown(void);
+static int send_erase_shown(void);
+static void viewport_rect(int *x, int *y, int *w, int *h);
 static void handle_resize(int sig);
+static int present_encode(void);
+static int present_row(int y);
+static int present_row_narrow(int y, int x0, int x1);
+#ifdef TB_OPT_THREADS
+static int present_bands(void);
+static int present_band(int band);
+#ifdef TB_OPT_THREADS_CHECK
+static int check_bands(void);
+#endif
+static void *present_worker(void *arg);
+static int init_workpool(void);
+static void workpool_free(void);
+#endif
 static int send_attr(uintattr_t fg, uintattr_t bg);
 static int send_sgr(uint32_t fg, uint32_t bg, int fg_is_default,
     int bg_is_default);
+static void attr_colors(uintattr_t fg, uintattr_t bg, uint32_t *cfg,
+    uint32_t *cbg);
+static int send_attr_delta(uintattr_t fg, uintattr_t bg);
+static int send_sgr_attrs(uintattr_t from_fg, uintattr_t from_bg, int reset,
+    uintattr_t fg, uintattr_t bg);
+static int send_sgr_param(int *nparams, uint32_t num);
+static int send_sgr_color(int *nparams, uint32_t c, int is_default,
+    int is_bg);
 static int send_cursor_if(int x, int y);
 static int send_char(int x, int y, uint32_t ch);
 static int send_cluster(int x, int y, uint32_t *ch, size_t nch);
+static int send_run(int x, int y, struct tb_cell *cell, int n, int eol);
+static int pick_run(struct tb_cell *cell, uint32_t ch, int n, int eol,
+    size_t cost_move);
+static int send_move_rel(int n, char dir);
+static size_t move_rel_cost(int n);
+static size_t move_step_cost(int n);
+static struct tb_cell *front_cell_at(int x, int y);
+static size_t reprint_cost(int x0, int x, int y);
+static size_t move_cost(int x, int y, int *how);
+static int send_move(int x, int y);
+static int send_move_down(int n);
+static int send_move_back(int n);
+static int send_move_fwd(int x0, int x, int y);
+static int sprite_encode(struct tb_sprite *sp);
+static int attr_is_default(uintattr_t attr);
 static int convert_num(uint32_t num, char *buf);
+static int send_number(uint32_t num);
+static int numtab_update(struct numtab *t, int w, int h);
+static int numtab_grow(struct numstr **tab, int *n, int want,
+    const char *pre, int offset, char post);
+static void numtab_free(struct numtab *t);
+static int num_len(uint32_t num);
 static int cell_cmp(struct tb_cell *a, struct tb_cell *b);
+static int cell_skip_same(struct tb_cell *a, struct tb_cell *b, int n);
 static int cell_copy(struct tb_cell *dst, struct tb_cell *src);
 static int cell_set(struct tb_cell *cell, uint32_t *ch, size_t nch,
     uintattr_t fg, uintattr_t bg);
@@ -2322,10 +2768,16 @@ static int cellbuf_clear(struct cellbuf *c);
 static int cellbuf_get(struct cellbuf *c, int x, int y, struct tb_cell **out);
 static int cellbuf_in_bounds(struct cellbuf *c, int x, int y);
 static int cellbuf_resize(struct cellbuf *c, int w, int h);
+static void cellbuf_dirty(struct cellbuf *c, int x, int y, int w);
+static void cellbuf_dirty_all(struct cellbuf *c);
 static int bytebuf_puts(struct bytebuf *b, const char *str);
 static int bytebuf_nputs(struct bytebuf *b, const char *str, size_t nstr);
 static int bytebuf_shift(struct bytebuf *b, size_t n);
+static int bytebuf_prepend(struct bytebuf *b, const char *str, size_t nstr);
 static int bytebuf_flush(struct bytebuf *b, int fd);
+static int flush_out(void);
+static void count_frame(void);
+static int restore_wfd_flags(void);
 static int bytebuf_reserve(struct bytebuf *b, size_t sz);
 static int bytebuf_free(struct bytebuf *b);
 static int tb_iswprint_ex(uint32_t ch, int *width);
@@ -2363,10 +2815,16 @@ int tb_init_rwfd(int rfd, int wfd) {
         if_err_break(rv, init_term_caps());
         if_err_break(rv, init_cap_trie());
         if_err_break(rv, init_resize_handler());
+#ifdef TB_OPT_EPOLL
+        if_err_break(rv, init_epoll());
+#endif
         if_err_break(rv, send_init_escape_codes());
         if_err_break(rv, send_clear());
         if_err_break(rv, update_term_size());
         if_err_break(rv, init_cellbuf());
+#ifdef TB_OPT_THREADS
+        if_err_break(rv, init_workpool());
+#endif
         global.initialized = 1;
     } while (0);
 
@@ -2406,83 +2864,554 @@ int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg) {
 int tb_present(void) {
     if_not_init_return();
 
+    int rv;
+    if_err_return(rv, present_encode());
+    if (global.out_pending > 0) {
+        count_frame();
+        return TB_OK;
+    }
+
+    // Frame the whole update, including anything blitted since the last
+    // present, unless there is nothing to show
+    if ((global.present_mode & TB_PRESENT_SYNC) &&
+        (global.extcaps & TB_EXTCAP_SYNC) && enc->out.len > 0)
+    {
+        if_err_return(rv, bytebuf_prepend(&enc->out, TB_HARDCAP_BEGIN_SYNC,
+                              strlen(TB_HARDCAP_BEGIN_SYNC)));
+        if_err_return(rv, bytebuf_puts(&enc->out, TB_HARDCAP_END_SYNC));
+    }
+    count_frame();
+    if_err_return(rv, flush_out());
+
+    // Start the next frame with an absolute move, in case the terminal was
+    // resized in between and moved the cursor
+    enc->last_x = -1;
+    enc->last_y = -1;
+
+    return TB_OK;
+}
+
+int tb_prepare(void) {
+    if_not_init_return();
+
+    int rv;
+    if_err_return(rv, present_encode());
+    if (global.out_pending == 0 && enc->out.len > 0) global.out_held = 1;
+    count_frame();
+    return TB_OK;
+}
+
+int tb_present_size(size_t *nbuf) {
+    if_not_init_return();
+    *nbuf = global.out_frame;
+    return TB_OK;
+}
+
+// Diff the back buffer against the front buffer and encode the changes into
+// `out`, unless the terminal is still busy with an earlier frame
+static int present_encode(void) {
     int rv;
 
     // TODO: Assert global.back.(width,height) == global.front.(width,height)
 
-    global.last_x = -1;
-    global.last_y = -1;
+    // Still busy with an earlier frame, keep changes in the back buffer so
+    // they are sent all at once when the terminal catches up
+    if (global.out_pending > 0) {
+        if_err_return(rv, flush_out());
+        if (global.out_pending > 0) return TB_OK;
+    }
+
+    if_err_return(rv, present_shown());
 
-    int x, y, i;
+#ifdef TB_OPT_THREADS_CHECK
+    if_err_return(rv, check_bands());
+#elif defined TB_OPT_THREADS
+    if_err_return(rv, present_bands());
+#else
+    int y;
     for (y = 0; y < global.front.height; y++) {
-        for (x = 0; x < global.front.width;) {
-            struct tb_cell *back, *front;
-            if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
-            if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
+        if_err_return(rv, present_row(y));
+    }
+#endif
 
-            int w;
-            {
+    return send_cursor_if(global.cursor_x, global.cursor_y);
+}
+
+// Diff and send one row
+static int present_row(int y) {
+    int rv, x, i;
+    struct cellbuf_row *row = &global.back.rows[y];
+    if (row->x0 >= row->x1) return TB_OK;
+
+    if (!row->has_wide
 #ifdef TB_OPT_EGC
-                if (back->nech > 0)
-                    w = tb_wcswidth(back->ech, back->nech);
-                else
+        && !row->has_ech
 #endif
-                    w = tb_wcwidth((wchar_t)back->ch);
-            }
-            if (w < 1) w = 1; // wcwidth qreturns -1 for invalid codepoints
+    ) {
+        if_err_return(rv, present_row_narrow(y, row->x0, row->x1));
+        row->x0 = row->x1 = 0;
+        return TB_OK;
+    }
+
+    int sx = global.buf_x; // screen position of the row
+    int sy = global.buf_y + y;
+    int x1 = row->has_wide ? global.front.width : row->x1;
+    for (x = row->has_wide ? 0 : row->x0; x < x1;) {
+        if (!row->has_wide) {
+            // Every cell is one column wide, so unchanged cells can be
+            // skipped in bulk without losing track of cell boundaries
+            int offset = (y * global.front.width) + x;
+            x += cell_skip_same(&global.back.cells[offset],
+                &global.front.cells[offset], x1 - x);
+            if (x >= x1) break;
+        }
 
-            if (cell_cmp(back, front) != 0) {
-                cell_copy(front, back);
+        struct tb_cell *back, *front;
+        if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
+        if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
+
+        int w;
+        {
+#ifdef TB_OPT_EGC
+            if (back->nech > 0)
+                w = tb_wcswidth(back->ech, back->nech);
+            else
+#endif
+                w = tb_wcwidth((wchar_t)back->ch);
+        }
+        if (w < 1) w = 1; // wcwidth qreturns -1 for invalid codepoints
 
+        if (cell_cmp(back, front) != 0) {
+            int run = 1;
+            if ((global.present_mode & TB_PRESENT_RLE) && w == 1
+#ifdef TB_OPT_EGC
+                && back->nech == 0
+#endif
+            ) {
+                // Extend over following changed cells with equal content
+                while (x + run < x1 && cell_cmp(back + run, back) == 0 &&
+                       cell_cmp(back + run, front + run) != 0)
+                {
+                    run++;
+                }
+            }
+            if (run > 1) {
                 send_attr(back->fg, back->bg);
-                if (w > 1 && x >= global.front.width - (w - 1)) {
-                    // Not enough room for wide char, send spaces
-                    for (i = x; i < global.front.width; i++) {
-                        send_char(i, y, ' ');
-                    }
-                } else {
-                    {
+                if_err_return(rv, send_run(sx + x, sy, back, run,
+                                      sx + x + run == global.width));
+                for (i = 0; i < run; i++) {
+                    cell_copy(front + i, back + i);
+                }
+                x += run;
+                continue;
+            }
+
+            cell_copy(front, back);
 #ifdef TB_OPT_EGC
-                        if (back->nech > 0)
-                            send_cluster(x, y, back->ech, back->nech);
-                        else
+            if (back->nech > 0) global.front.rows[y].has_ech = 1;
 #endif
-                            send_char(x, y, back->ch);
-                    }
 
-                    // When wcwidth>1, we need to advance the cursor by more
-                    // than 1, thereby skipping some cells. Set these skipped
-                    // cells to an invalid codepoint in the front buffer, so
-                    // that if this cell is later replaced by a wcwidth==1 char,
-                    // we'll get a cell_cmp diff for the skipped cells and
-                    // properly re-render.
-                    for (i = 1; i < w; i++) {
-                        struct tb_cell *front_wide;
-                        uint32_t invalid = -1;
-                        if_err_return(rv,
-                            cellbuf_get(&global.front, x + i, y, &front_wide));
-                        if_err_return(rv,
-                            cell_set(front_wide, &invalid, 1, -1, -1));
-                    }
+            send_attr(back->fg, back->bg);
+            if (w > 1 && x >= global.front.width - (w - 1)) {
+                // Not enough room for wide char, send spaces
+                for (i = x; i < global.front.width; i++) {
+                    send_char(sx + i, sy, ' ');
+                }
+            } else {
+                {
+#ifdef TB_OPT_EGC
+                    if (back->nech > 0)
+                        send_cluster(sx + x, sy, back->ech, back->nech);
+                    else
+#endif
+                        send_char(sx + x, sy, back->ch);
+                }
+
+                // When wcwidth>1, we need to advance the cursor by more
+                // than 1, thereby skipping some cells. Set these skipped
+                // cells to an invalid codepoint in the front buffer, so
+                // that if this cell is later replaced by a wcwidth==1 char,
+                // we'll get a cell_cmp diff for the skipped cells and
+                // properly re-render.
+                for (i = 1; i < w; i++) {
+                    struct tb_cell *front_wide;
+                    uint32_t invalid = -1;
+                    if_err_return(rv,
+                        cellbuf_get(&global.front, x + i, y, &front_wide));
+                    if_err_return(rv,
+                        cell_set(front_wide, &invalid, 1, -1, -1));
                 }
             }
-            x += w;
         }
+        x += w;
     }
+    row->x0 = row->x1 = 0;
+    return TB_OK;
+}
 
-    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+#ifdef TB_OPT_THREADS
+static int present_bands(void) {
+    int rv;
+    struct workpool *pool = &global.pool;
+    int nbands = (global.front.height + TB_BAND_ROWS - 1) / TB_BAND_ROWS;
+    if (nbands > pool->bands_cap) {
+        struct band *bands = (struct band *)tb_realloc(pool->bands,
+            sizeof(struct band) * (size_t)nbands);
+        if (!bands) return TB_ERR_MEM;
+        memset(&bands[pool->bands_cap], 0,
+            sizeof(struct band) * (size_t)(nbands - pool->bands_cap));
+        pool->bands = bands;
+        pool->bands_cap = nbands;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nbands = nbands;
+    pool->next = 0;
+    pool->ndone = 0;
+    pool->rv = TB_OK;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->next < pool->nbands) {
+        int band = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        rv = present_band(band);
+        pthread_mutex_lock(&pool->lock);
+        if (rv != TB_OK) pool->rv = rv;
+        pool->ndone++;
+    }
+    while (pool->ndone < pool->nbands) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    rv = pool->rv;
+    pthread_mutex_unlock(&pool->lock);
+    if (rv != TB_OK) return rv;
+
+    // Put the bands together in order. Each row the band encoded from a
+    // state other than the one the rows before actually leave is put back
+    // and encoded again here; from the first row that started from the
+    // right state on, the band's own bytes are the ones a single thread
+    // would send.
+    int i, r;
+    for (i = 0; i < nbands; i++) {
+        struct band *band = &pool->bands[i];
+        int y0 = i * TB_BAND_ROWS;
+        int n = global.front.height - y0;
+        if (n > TB_BAND_ROWS) n = TB_BAND_ROWS;
+        for (r = 0; r < n; r++) {
+            struct band_row *row = &band->rows[r];
+            if (row->last_x == global.enc.last_x
+                && row->last_y == global.enc.last_y
+                && row->attr_known == global.enc.attr_known
+                && (!row->attr_known || (row->last_fg == global.enc.last_fg
+                                         && row->last_bg == global.enc.last_bg)))
+            {
+                break;
+            }
+            if (row->saved_x < 0) continue; // nothing sent either way
+            int y = y0 + r;
+            int w = global.front.width;
+            int x;
+            // The band may have left cluster buffers in the row's cells, and
+            // the restored cells keep them
+            int has_ech = global.front.rows[y].has_ech;
+            global.back.rows[y] = row->back;
+            global.front.rows[y] = row->front;
+            global.front.rows[y].has_ech |= has_ech;
+            for (x = row->saved_x; x < w; x++) {
+                if_err_return(rv, cell_copy(&global.front.cells[y * w + x],
+                                      &band->saved[r * w + x]));
+            }
+            if_err_return(rv, present_row(y));
+        }
+        if (r == n) continue;
+        if_err_return(rv,
+            bytebuf_nputs(&global.enc.out, band->enc.out.buf + band->rows[r].off,
+                band->enc.out.len - band->rows[r].off));
+        global.enc.last_x = band->enc.last_x;
+        global.enc.last_y = band->enc.last_y;
+        global.enc.last_fg = band->enc.last_fg;
+        global.enc.last_bg = band->enc.last_bg;
+        global.enc.attr_known = band->enc.attr_known;
+    }
+    return TB_OK;
+}
+
+// Diff and encode the rows of `band` into its own encoder. The first band
+// starts from what the terminal is known to show; the others can't know
+// where the band before leaves the cursor, so they assume nothing and keep
+// what `present_bands` needs to redo their first rows.
+static int present_band(int band) {
+    int rv = TB_OK;
+    struct band *b = &global.pool.bands[band];
+    struct encoder *saved = enc;
+    int w = global.front.width;
+    if (b->saved_cap < w * TB_BAND_ROWS) {
+        struct tb_cell *cells = (struct tb_cell *)tb_realloc(b->saved,
+            sizeof(struct tb_cell) * (size_t)(w * TB_BAND_ROWS));
+        if (!cells) return TB_ERR_MEM;
+        memset(&cells[b->saved_cap], 0,
+            sizeof(struct tb_cell) * (size_t)(w * TB_BAND_ROWS - b->saved_cap));
+        b->saved = cells;
+        b->saved_cap = w * TB_BAND_ROWS;
+    }
+
+    enc = &b->enc;
+    enc->out.len = 0;
+    if (band == 0) {
+        enc->last_x = global.enc.last_x;
+        enc->last_y = global.enc.last_y;
+        enc->last_fg = global.enc.last_fg;
+        enc->last_bg = global.enc.last_bg;
+        enc->attr_known = global.enc.attr_known;
+    } else {
+        enc->last_x = -1;
+        enc->last_y = -1;
+        enc->last_fg = ~global.fg;
+        enc->last_bg = ~global.bg;
+        enc->attr_known = 0;
+    }
+
+    int y0 = band * TB_BAND_ROWS;
+    int y1 = y0 + TB_BAND_ROWS;
+    int y, x;
+    if (y1 > global.front.height) y1 = global.front.height;
+    for (y = y0; y < y1; y++) {
+        struct band_row *row = &b->rows[y - y0];
+        row->off = enc->out.len;
+        row->last_x = enc->last_x;
+        row->last_y = enc->last_y;
+        row->last_fg = enc->last_fg;
+        row->last_bg = enc->last_bg;
+        row->attr_known = enc->attr_known;
+        row->back = global.back.rows[y];
+        row->front = global.front.rows[y];
+        row->saved_x = -1;
+        if (row->back.x0 < row->back.x1) {
+            // `present_row` writes front cells from the span on, and past
+            // its end to clear wide characters
+            row->saved_x = row->back.has_wide ? 0 : row->back.x0;
+            for (x = row->saved_x; x < w; x++) {
+                if_err_break(rv, cell_copy(&b->saved[(y - y0) * w + x],
+                                     &global.front.cells[y * w + x]));
+            }
+            if (rv != TB_OK) break;
+        }
+        if_err_break(rv, present_row(y));
+    }
+    enc = saved;
+    return rv;
+}
+
+#ifdef TB_OPT_THREADS_CHECK
+// Encode the frame on this thread into a scratch encoder, put the buffers
+// back as they were, then encode it in bands and abort if anything differs
+static int check_bands(void) {
+    int rv = TB_OK;
+    int w = global.front.width, h = global.front.height;
+    int i, y;
+    struct encoder serial;
+    struct tb_cell *front;
+    struct cellbuf_row *rows;
+
+    front = (struct tb_cell *)tb_malloc(sizeof(struct tb_cell) * w * h);
+    if (!front) return TB_ERR_MEM;
+    memset(front, 0, sizeof(struct tb_cell) * w * h);
+    rows = (struct cellbuf_row *)tb_malloc(sizeof(struct cellbuf_row) * h * 2);
+    if (!rows) {
+        tb_free(front);
+        return TB_ERR_MEM;
+    }
+    memcpy(rows, global.back.rows, sizeof(struct cellbuf_row) * h);
+    memcpy(rows + h, global.front.rows, sizeof(struct cellbuf_row) * h);
+    for (i = 0; i < w * h; i++) {
+        if_err_break(rv, cell_copy(&front[i], &global.front.cells[i]));
+    }
+
+    memset(&serial, 0, sizeof(serial));
+    serial.last_x = global.enc.last_x;
+    serial.last_y = global.enc.last_y;
+    serial.last_fg = global.enc.last_fg;
+    serial.last_bg = global.enc.last_bg;
+    serial.attr_known = global.enc.attr_known;
+    enc = &serial;
+    for (y = 0; rv == TB_OK && y < h; y++) {
+        rv = present_row(y);
+    }
+    enc = &global.enc;
+
+    for (i = 0; rv == TB_OK && i < w * h; i++) {
+        rv = cell_copy(&global.front.cells[i], &front[i]);
+    }
+    memcpy(global.back.rows, rows, sizeof(struct cellbuf_row) * h);
+    for (y = 0; y < h; y++) {
+        // Keep the flag for cluster buffers the serial run left in cells
+        int has_ech = global.front.rows[y].has_ech;
+        global.front.rows[y] = rows[h + y];
+        global.front.rows[y].has_ech |= has_ech;
+    }
+
+    size_t start = global.enc.out.len;
+    if (rv == TB_OK) rv = present_bands();
+    if (rv == TB_OK
+        && (global.enc.out.len - start != serial.out.len
+            || memcmp(global.enc.out.buf + start, serial.out.buf,
+                   serial.out.len) != 0
+            || global.enc.last_x != serial.last_x
+            || global.enc.last_y != serial.last_y
+            || global.enc.attr_known != serial.attr_known))
+    {
+        abort();
+    }
+
+    bytebuf_free(&serial.out);
+    for (i = 0; i < w * h; i++) {
+        cell_free(&front[i]);
+    }
+    tb_free(front);
+    tb_free(rows);
+    return rv;
+}
+#endif
 
+static void *present_worker(void *arg) {
+    struct workpool *pool = &global.pool;
+    unsigned gen = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->gen == gen && !pool->quit) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->quit) break;
+        gen = pool->gen;
+        while (pool->next < pool->nbands) {
+            int band = pool->next++;
+            pthread_mutex_unlock(&pool->lock);
+            int rv = present_band(band);
+            pthread_mutex_lock(&pool->lock);
+            if (rv != TB_OK) pool->rv = rv;
+            if (++pool->ndone == pool->nbands) {
+                pthread_cond_signal(&pool->done);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Start the workers. If some fail to start, the rest (or the caller alone)
+// take all the bands.
+static int init_workpool(void) {
+    struct workpool *pool = &global.pool;
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) return TB_ERR;
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->started = 1;
+    while (pool->nthreads < TB_OPT_THREADS - 1) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL,
+                present_worker, NULL) != 0)
+        {
+            break;
+        }
+        pool->nthreads++;
+    }
+    return TB_OK;
+}
+
+static void workpool_free(void) {
+    struct workpool *pool = &global.pool;
+    int i;
+    if (!pool->started) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    for (i = 0; i < pool->bands_cap; i++) {
+        struct band *band = &pool->bands[i];
+        int j;
+        bytebuf_free(&band->enc.out);
+        for (j = 0; j < band->saved_cap; j++) {
+            cell_free(&band->saved[j]);
+        }
+        if (band->saved) tb_free(band->saved);
+    }
+    if (pool->bands) tb_free(pool->bands);
+    memset(pool, 0, sizeof(*pool));
+}
+#endif
+
+// Present columns `[x0, x1)` of a row whose back buffer cells are all one
+// column wide and hold no clusters. Nothing there needs a width lookup or a
+// bounds check, so this walks the rows directly.
+static int present_row_narrow(int y, int x0, int x1) {
+    int rv, i;
+    int offset = y * global.front.width;
+    int sx = global.buf_x; // screen position of the row
+    int sy = global.buf_y + y;
+    struct tb_cell *back = &global.back.cells[offset];
+    struct tb_cell *front = &global.front.cells[offset];
+    int x = x0;
+    while (x < x1) {
+        x += cell_skip_same(back + x, front + x, x1 - x);
+        if (x >= x1) break;
+        if (cell_cmp(back + x, front + x) == 0) {
+            x++;
+            continue;
+        }
+
+        int run = 1;
+        if (global.present_mode & TB_PRESENT_RLE) {
+            while (x + run < x1 && cell_cmp(back + x + run, back + x) == 0 &&
+                   cell_cmp(back + x + run, front + x + run) != 0)
+            {
+                run++;
+            }
+        }
+
+        if_err_return(rv, send_attr(back[x].fg, back[x].bg));
+        if (run > 1) {
+            if_err_return(rv, send_run(sx + x, sy, back + x, run,
+                                  sx + x + run == global.width));
+        } else {
+            if_err_return(rv, send_char(sx + x, sy, back[x].ch));
+        }
+        for (i = 0; i < run; i++) {
+            if_err_return(rv, cell_copy(front + x + i, back + x + i));
+        }
+        x += run;
+    }
     return TB_OK;
 }
 
 int tb_invalidate(void) {
     int rv;
     if_not_init_return();
-    if_err_return(rv, resize_cellbufs());
+    if_err_return(rv, resize_cellbufs(0));
     return TB_OK;
 }
 
+int tb_set_viewport(int x, int y, int w, int h) {
+    if_not_init_return();
+    if (w <= 0 || h <= 0) x = y = w = h = 0;
+    if (x == global.view_x && y == global.view_y && w == global.view_w &&
+        h == global.view_h)
+    {
+        return TB_OK;
+    }
+    global.view_x = x;
+    global.view_y = y;
+    global.view_w = w;
+    global.view_h = h;
+    return resize_cellbufs(global.present_mode & TB_PRESENT_KEEP);
+}
+
 int tb_set_cursor(int cx, int cy) {
     if_not_init_return();
     int rv;
@@ -2490,7 +3419,7 @@ int tb_set_cursor(int cx, int cy) {
     if (cy < 0) cy = 0;
     if (global.cursor_x == -1) {
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_SHOW_CURSOR]));
     }
     if_err_return(rv, send_cursor_if(cx, cy));
     global.cursor_x = cx;
@@ -2503,7 +3432,7 @@ int tb_hide_cursor(void) {
     int rv;
     if (global.cursor_x >= 0) {
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_HIDE_CURSOR]));
     }
     global.cursor_x = -1;
     global.cursor_y = -1;
@@ -2517,16 +3446,22 @@ int tb_set_cell(int x, int y, uint32_t ch, uintattr_t fg, uintattr_t bg) {
 int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg) {
     if_not_init_return();
-    int rv;
+    int rv, w = 1;
     struct tb_cell *cell;
+    x -= global.buf_x;
+    y -= global.buf_y;
     if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
     if_err_return(rv, cell_set(cell, ch, nch, fg, bg));
+    if (nch > 1 || (ch && *ch > 0x7e)) w = tb_wcswidth(ch, nch);
+    if (nch > 1) global.back.rows[y].has_ech = 1;
+    cellbuf_dirty(&global.back, x, y, w);
     return TB_OK;
 }
 
 int tb_get_cell(int x, int y, int back, struct tb_cell **cell) {
     if_not_init_return();
-    return cellbuf_get(back ? &global.back : &global.front, x, y, cell);
+    return cellbuf_get(back ? &global.back : &global.front, x - global.buf_x,
+        y - global.buf_y, cell);
 }
 
 int tb_extend_cell(int x, int y, uint32_t ch) {
@@ -2536,6 +3471,8 @@ int tb_extend_cell(int x, int y, uint32_t ch) {
     int rv;
     struct tb_cell *cell;
     size_t nech;
+    x -= global.buf_x;
+    y -= global.buf_y;
     if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
     if (cell->nech > 0) { // append to ech
         nech = cell->nech + 1;
@@ -2549,6 +3486,8 @@ int tb_extend_cell(int x, int y, uint32_t ch) {
     }
     cell->ech[nech] = '\0';
     cell->nech = nech;
+    global.back.rows[y].has_ech = 1;
+    cellbuf_dirty(&global.back, x, y, tb_wcswidth(cell->ech, nech));
     return TB_OK;
 #else
     (void)x;
@@ -2558,60 +3497,242 @@ int tb_extend_cell(int x, int y, uint32_t ch) {
 #endif
 }
 
-int tb_set_input_mode(int mode) {
-    if_not_init_return();
-
-    if (mode == TB_INPUT_CURRENT) return global.input_mode;
+int tb_sprite_init(struct tb_sprite *sp, int w, int h, struct tb_cell *cells) {
+    int i;
 
-    int esc_or_alt = TB_INPUT_ESC | TB_INPUT_ALT;
-    if ((mode & esc_or_alt) == 0) {
-        // neither specified; flip on ESC
-        mode |= TB_INPUT_ESC;
-    } else if ((mode & esc_or_alt) == esc_or_alt) {
-        // both specified; flip off ALT
-        mode &= ~TB_INPUT_ALT;
+    memset(sp, 0, sizeof(*sp));
+    if (w < 1 || h < 1) return TB_ERR;
+    for (i = 0; i < w * h; i++) {
+#ifdef TB_OPT_EGC
+        if (cells[i].nech > 0) return TB_ERR;
+#endif
+        if (tb_wcwidth(cells[i].ch) > 1) return TB_ERR;
     }
 
-    if (mode & TB_INPUT_MOUSE) {
-        bytebuf_puts(&global.out, TB_HARDCAP_ENTER_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
-    } else {
-        bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+    sp->cells = (struct tb_cell *)tb_malloc(sizeof(struct tb_cell) * w * h);
+    if (!sp->cells) return TB_ERR_MEM;
+    memset(sp->cells, 0, sizeof(struct tb_cell) * w * h);
+    for (i = 0; i < w * h; i++) {
+        sp->cells[i].ch = cells[i].ch;
+        sp->cells[i].fg = cells[i].fg;
+        sp->cells[i].bg = cells[i].bg;
     }
-
-    global.input_mode = mode;
+    sp->w = w;
+    sp->h = h;
     return TB_OK;
 }
 
-int tb_set_output_mode(int mode) {
+int tb_sprite_blit(struct tb_sprite *sp, int x, int y) {
     if_not_init_return();
-    switch (mode) {
-        case TB_OUTPUT_CURRENT:
-            return global.output_mode;
-        case TB_OUTPUT_NORMAL:
-        case TB_OUTPUT_256:
-        case TB_OUTPUT_216:
+
+    int rv, i, j;
+    int bx = x - global.buf_x; // position in the cell buffers
+    int by = y - global.buf_y;
+
+    if (bx < 0 || by < 0 || bx + sp->w > global.back.width ||
+        by + sp->h > global.back.height || x + sp->w >= global.width ||
+        global.out_pending > 0 || global.shown_valid)
+    {
+        // Relative moves can't be trusted near the edges, so let the regular
+        // diff take care of it. Same while output is backed up, so the cells
+        // can be coalesced with later changes, and after a kept resize, which
+        // the next present has to sort out first.
+        for (j = 0; j < sp->h; j++) {
+            for (i = 0; i < sp->w; i++) {
+                struct tb_cell *cell = &sp->cells[(j * sp->w) + i];
+                if (cell->ch == 0) continue;
+                if (!cellbuf_in_bounds(&global.back, bx + i, by + j)) continue;
+                if_err_return(rv,
+                    tb_set_cell(x + i, y + j, cell->ch, cell->fg, cell->bg));
+            }
+        }
+        return TB_OK;
+    }
+
+    if (sp->output_mode != global.output_mode ||
+        sp->present_mode != global.present_mode)
+    {
+        if_err_return(rv, sprite_encode(sp));
+    }
+    if (sp->nbuf == 0) return TB_OK;
+
+    struct tb_cell *first = &sp->cells[(sp->start_y * sp->w) + sp->start_x];
+    if_err_return(rv, send_attr(first->fg, first->bg));
+    if_err_return(rv, send_move(x + sp->start_x, y + sp->start_y));
+    if_err_return(rv, bytebuf_nputs(&enc->out, sp->buf, sp->nbuf));
+    enc->last_x = x + sp->end_x - 1;
+    enc->last_y = y + sp->end_y;
+    enc->last_fg = sp->end_fg;
+    enc->last_bg = sp->end_bg;
+    enc->attr_known = 1;
+
+    // The screen now shows the sprite, so both buffers must say so
+    for (j = 0; j < sp->h; j++) {
+        for (i = 0; i < sp->w; i++) {
+            struct tb_cell *cell = &sp->cells[(j * sp->w) + i];
+            struct tb_cell *back, *front;
+            if (cell->ch == 0) continue;
+            if_err_return(rv,
+                cellbuf_get(&global.back, bx + i, by + j, &back));
+            if_err_return(rv,
+                cellbuf_get(&global.front, bx + i, by + j, &front));
+            if_err_return(rv, cell_set(back, &cell->ch, 1, cell->fg, cell->bg));
+            if_err_return(rv,
+                cell_set(front, &cell->ch, 1, cell->fg, cell->bg));
+        }
+    }
+
+    return TB_OK;
+}
+
+int tb_sprite_size(struct tb_sprite *sp, size_t *nbuf) {
+    if_not_init_return();
+
+    int rv;
+    if (sp->output_mode != global.output_mode ||
+        sp->present_mode != global.present_mode)
+    {
+        if_err_return(rv, sprite_encode(sp));
+    }
+    *nbuf = sp->nbuf;
+    return TB_OK;
+}
+
+int tb_sprite_free(struct tb_sprite *sp) {
+    if (sp->cells) tb_free(sp->cells);
+    if (sp->buf) tb_free(sp->buf);
+    memset(sp, 0, sizeof(*sp));
+    return TB_OK;
+}
+
+int tb_set_input_mode(int mode) {
+    if_not_init_return();
+
+    if (mode == TB_INPUT_CURRENT) return global.input_mode;
+
+    int esc_or_alt = TB_INPUT_ESC | TB_INPUT_ALT;
+    if ((mode & esc_or_alt) == 0) {
+        // neither specified; flip on ESC
+        mode |= TB_INPUT_ESC;
+    } else if ((mode & esc_or_alt) == esc_or_alt) {
+        // both specified; flip off ALT
+        mode &= ~TB_INPUT_ALT;
+    }
+
+    if (mode & TB_INPUT_MOUSE) {
+        bytebuf_puts(&enc->out, TB_HARDCAP_ENTER_MOUSE);
+        flush_out();
+    } else {
+        bytebuf_puts(&enc->out, TB_HARDCAP_EXIT_MOUSE);
+        flush_out();
+    }
+
+    global.input_mode = mode;
+    return TB_OK;
+}
+
+int tb_set_output_mode(int mode) {
+    if_not_init_return();
+    switch (mode) {
+        case TB_OUTPUT_CURRENT:
+            return global.output_mode;
+        case TB_OUTPUT_NORMAL:
+        case TB_OUTPUT_256:
+        case TB_OUTPUT_216:
         case TB_OUTPUT_GRAYSCALE:
 #if TB_OPT_ATTR_W >= 32
         case TB_OUTPUT_TRUECOLOR:
 #endif
-            global.last_fg = ~global.fg;
-            global.last_bg = ~global.bg;
+            enc->last_fg = ~global.fg;
+            enc->last_bg = ~global.bg;
+            enc->attr_known = 0;
             global.output_mode = mode;
             return TB_OK;
     }
     return TB_ERR;
 }
 
+int tb_set_present_mode(int mode) {
+    if_not_init_return();
+
+    if (mode == TB_PRESENT_CURRENT) return global.present_mode;
+
+    int rv;
+    if ((mode & TB_PRESENT_NONBLOCK) && global.wfd_flags < 0) {
+        int flags = fcntl(global.wfd, F_GETFL);
+        if (flags < 0 || fcntl(global.wfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            global.last_errno = errno;
+            return TB_ERR;
+        }
+        global.wfd_flags = flags;
+    } else if (!(mode & TB_PRESENT_NONBLOCK) && global.wfd_flags >= 0) {
+        if_err_return(rv, restore_wfd_flags());
+        if_err_return(rv, flush_out());
+    }
+
+    global.present_mode = mode | TB_PRESENT_NORMAL;
+
+    if ((mode & TB_PRESENT_SYNC) && !global.sync_queried) {
+        global.sync_queried = 1;
+        if_err_return(rv, bytebuf_puts(&enc->out, TB_HARDCAP_QUERY_SYNC));
+        if_err_return(rv, flush_out());
+    }
+    return TB_OK;
+}
+
 int tb_peek_event(struct tb_event *event, int timeout_ms) {
+    struct timespec deadline;
     if_not_init_return();
-    return wait_event(event, timeout_ms);
+    if (timeout_ms < 0) return wait_event(event, CLOCK_MONOTONIC, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return wait_event(event, CLOCK_MONOTONIC, &deadline);
 }
 
 int tb_poll_event(struct tb_event *event) {
     if_not_init_return();
-    return wait_event(event, -1);
+    return wait_event(event, CLOCK_MONOTONIC, NULL);
+}
+
+int tb_peek_event_until(struct tb_event *event, clockid_t clock,
+    const struct timespec *deadline) {
+    if_not_init_return();
+    return wait_event(event, clock, deadline);
+}
+
+int tb_add_fd(int fd) {
+    if_not_init_return();
+    if (fd < 0 || global.nextra_fds >= TB_OPT_EXTRA_FDS) return TB_ERR;
+#ifdef TB_OPT_EPOLL
+    if (global.epfd >= 0) {
+        int rv;
+        if_err_return(rv, epoll_watch(EPOLL_CTL_ADD, fd, EPOLLIN));
+    }
+#endif
+    global.extra_fds[global.nextra_fds++] = fd;
+    return TB_OK;
+}
+
+int tb_del_fd(int fd) {
+    int i;
+    if_not_init_return();
+    for (i = 0; i < global.nextra_fds; i++) {
+        if (global.extra_fds[i] != fd) continue;
+        global.extra_fds[i] = global.extra_fds[--global.nextra_fds];
+#ifdef TB_OPT_EPOLL
+        if (global.epfd >= 0) {
+            int rv;
+            if_err_return(rv, epoll_watch(EPOLL_CTL_DEL, fd, 0));
+        }
+#endif
+        return TB_OK;
+    }
+    return TB_ERR;
 }
 
 int tb_get_fds(int *ttyfd, int *resizefd) {
@@ -2634,7 +3755,7 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 
     if_not_init_return();
 
-    if (!cellbuf_in_bounds(&global.back, x, y)) {
+    if (!cellbuf_in_bounds(&global.back, x - global.buf_x, y - global.buf_y)) {
         return TB_ERR_OUT_OF_BOUNDS;
     }
 
@@ -2667,11 +3788,15 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
         if (w < 0) {
             return TB_ERR;   // shouldn't happen if iswprint
         } else if (w == 0) { // combining character
-            if (cellbuf_in_bounds(&global.back, x_prev, y)) {
+            if (cellbuf_in_bounds(&global.back, x_prev - global.buf_x,
+                    y - global.buf_y))
+            {
                 if_err_return(rv, tb_extend_cell(x_prev, y, uni));
             }
         } else {
-            if (cellbuf_in_bounds(&global.back, x, y)) {
+            if (cellbuf_in_bounds(&global.back, x - global.buf_x,
+                    y - global.buf_y))
+            {
                 if_err_return(rv, tb_set_cell(x, y, uni, fg, bg));
             }
             x_prev = x;
@@ -2704,7 +3829,10 @@ int tb_printf_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 }
 
 int tb_send(const char *buf, size_t nbuf) {
-    return bytebuf_nputs(&global.out, buf, nbuf);
+    // Whatever this is, it may move the cursor
+    enc->last_x = -1;
+    enc->last_y = -1;
+    return bytebuf_nputs(&enc->out, buf, nbuf);
 }
 
 int tb_sendf(const char *fmt, ...) {
@@ -2734,6 +3862,8 @@ int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *)) {
 
 struct tb_cell *tb_cell_buffer(void) {
     if (!global.initialized) return NULL;
+    // Callers may write through the returned pointer, so assume they do
+    cellbuf_dirty_all(&global.back);
     return global.back.cells;
 }
 
@@ -2878,14 +4008,21 @@ static int tb_reset(void) {
     global.height = -1;
     global.cursor_x = -1;
     global.cursor_y = -1;
-    global.last_x = -1;
-    global.last_y = -1;
+    enc->last_x = -1;
+    enc->last_y = -1;
     global.fg = TB_DEFAULT;
     global.bg = TB_DEFAULT;
-    global.last_fg = ~global.fg;
-    global.last_bg = ~global.bg;
+    enc->last_fg = ~global.fg;
+    enc->last_bg = ~global.bg;
     global.input_mode = TB_INPUT_ESC;
     global.output_mode = TB_OUTPUT_NORMAL;
+    global.present_mode = TB_PRESENT_NORMAL;
+    global.wfd_flags = -1;
+#ifdef TB_OPT_EPOLL
+    global.epfd = -1;
+    global.timerfd[0] = -1;
+    global.timerfd[1] = -1;
+#endif
     return TB_OK;
 }
 
@@ -2925,10 +4062,53 @@ int tb_printf_inner(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 }
 
 static int init_term_caps(void) {
+    int rv;
     if (load_terminfo() == TB_OK) {
-        return parse_terminfo_caps();
+        if_err_return(rv, parse_terminfo_caps());
+    } else {
+        if_err_return(rv, load_builtin_caps());
+    }
+    return init_sgr_delta();
+}
+
+// Attribute changes can be sent as deltas (`CSI 22 m` and friends) only if the
+// terminal speaks plain ECMA-48 SGR, so every style cap it has must be the
+// standard sequence. Missing caps just leave their attribute out.
+static int init_sgr_delta(void) {
+    static const struct {
+        int cap;
+        const char *seq;
+        uintattr_t attr;
+    } style_caps[] = {
+        {TB_CAP_BOLD, "\x1b[1m", TB_BOLD},
+        {TB_CAP_DIM, "\x1b[2m", TB_DIM},
+        {TB_CAP_ITALIC, "\x1b[3m", TB_ITALIC},
+        {TB_CAP_UNDERLINE, "\x1b[4m", TB_UNDERLINE},
+        {TB_CAP_BLINK, "\x1b[5m", TB_BLINK},
+        {TB_CAP_REVERSE, "\x1b[7m", TB_REVERSE},
+#if TB_OPT_ATTR_W == 64
+        {TB_CAP_INVISIBLE, "\x1b[8m", TB_INVISIBLE},
+#endif
+    };
+    size_t i;
+
+    global.sgr_attrs = 0;
+    for (i = 0; i < sizeof(style_caps) / sizeof(style_caps[0]); i++) {
+        const char *cap = global.caps[style_caps[i].cap];
+        if (!cap || !*cap) continue;
+        if (strcmp(cap, style_caps[i].seq) != 0) {
+            global.sgr_attrs = 0;
+            return TB_OK;
+        }
+        global.sgr_attrs |= style_caps[i].attr;
     }
-    return load_builtin_caps();
+#if TB_OPT_ATTR_W == 64
+    // Always sent as hard-coded ECMA-48 sequences
+    if (global.sgr_attrs) {
+        global.sgr_attrs |= TB_STRIKEOUT | TB_UNDERLINE_2 | TB_OVERLINE;
+    }
+#endif
+    return TB_OK;
 }
 
 static int init_cap_trie(void) {
@@ -3063,28 +4243,127 @@ static int init_resize_handler(void) {
     return TB_OK;
 }
 
+#ifdef TB_OPT_EPOLL
+// Set up the persistent epoll instance and the deadline timers. If any of
+// it fails, e.g. because epoll can't watch a tty that's a regular file,
+// none of it is kept and `select` is used instead
+static int init_epoll(void) {
+    int i;
+
+    global.epfd = epoll_create1(EPOLL_CLOEXEC);
+    for (i = 0; i < 2; i++) {
+        global.timerfd[i] = timerfd_create(i ? CLOCK_REALTIME : CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+    if (global.epfd >= 0 && global.timerfd[0] >= 0 &&
+        global.timerfd[1] >= 0 &&
+        epoll_watch(EPOLL_CTL_ADD, global.rfd, EPOLLIN) == TB_OK &&
+        epoll_watch(EPOLL_CTL_ADD, global.resize_pipefd[0], EPOLLIN) ==
+            TB_OK &&
+        epoll_watch(EPOLL_CTL_ADD, global.timerfd[0], EPOLLIN) == TB_OK &&
+        epoll_watch(EPOLL_CTL_ADD, global.timerfd[1], EPOLLIN) == TB_OK)
+    {
+        return TB_OK;
+    }
+
+    if (global.epfd >= 0) close(global.epfd);
+    global.epfd = -1;
+    for (i = 0; i < 2; i++) {
+        if (global.timerfd[i] >= 0) close(global.timerfd[i]);
+        global.timerfd[i] = -1;
+    }
+    return TB_OK;
+}
+
+static int epoll_watch(int op, int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(global.epfd, op, fd, &ev) != 0) {
+        global.last_errno = errno;
+        return TB_ERR_POLL;
+    }
+    return TB_OK;
+}
+
+// Watch `wfd` for writability only while output is pending, as a tty is
+// nearly always writable
+static int epoll_watch_out(int on) {
+    int rv;
+    if (on == global.epoll_out) return TB_OK;
+    if (global.wfd == global.rfd) {
+        if_err_return(rv, epoll_watch(EPOLL_CTL_MOD, global.wfd,
+                              EPOLLIN | (on ? EPOLLOUT : 0)));
+    } else {
+        if_err_return(rv, epoll_watch(on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                              global.wfd, EPOLLOUT));
+    }
+    global.epoll_out = on;
+    return TB_OK;
+}
+
+// Arm timer `t` (0 monotonic, 1 realtime) for the absolute `deadline`, or
+// disarm it if NULL. Skipped if it's already armed that way
+static int arm_timer(int t, const struct timespec *deadline) {
+    struct itimerspec its;
+
+    if (!deadline && !global.timer_armed[t]) return TB_OK;
+    if (deadline && global.timer_armed[t] &&
+        global.timer_at[t].tv_sec == deadline->tv_sec &&
+        global.timer_at[t].tv_nsec == deadline->tv_nsec)
+    {
+        return TB_OK;
+    }
+
+    memset(&its, 0, sizeof(its));
+    if (deadline) {
+        its.it_value = *deadline;
+        // An all-zero time would disarm rather than fire at once
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+            its.it_value.tv_nsec = 1;
+        }
+    }
+    if (timerfd_settime(global.timerfd[t], TFD_TIMER_ABSTIME, &its, NULL) != 0)
+    {
+        global.last_errno = errno;
+        return TB_ERR_POLL;
+    }
+    global.timer_armed[t] = (deadline != NULL);
+    if (deadline) global.timer_at[t] = *deadline;
+    return TB_OK;
+}
+#endif
+
 static int send_init_escape_codes(void) {
     int rv;
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_CA]));
+    if_err_return(rv, bytebuf_puts(&enc->out, global.caps[TB_CAP_ENTER_CA]));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_KEYPAD]));
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_ENTER_KEYPAD]));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_HIDE_CURSOR]));
     return TB_OK;
 }
 
 static int send_clear(void) {
     int rv;
+    if_err_return(rv, queue_clear());
+    return flush_out();
+}
+
+// Encode a screen clear into `out` without writing it, so that it goes out
+// with the rest of the next present, inside its synchronized update
+static int queue_clear(void) {
+    int rv;
 
     if_err_return(rv, send_attr(global.fg, global.bg));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]));
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_CLEAR_SCREEN]));
 
     if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
 
-    global.last_x = -1;
-    global.last_y = -1;
+    enc->last_x = -1;
+    enc->last_y = -1;
 
     return TB_OK;
 }
@@ -3158,23 +4437,29 @@ static int update_term_size_via_esc(void) {
 }
 
 static int init_cellbuf(void) {
-    int rv;
-    if_err_return(rv, cellbuf_init(&global.back, global.width, global.height));
-    if_err_return(rv, cellbuf_init(&global.front, global.width, global.height));
+    int rv, w, h;
+    viewport_rect(&global.buf_x, &global.buf_y, &w, &h);
+    global.fit_w = global.width;
+    global.fit_h = global.height;
+    if_err_return(rv, cellbuf_init(&global.back, w, h));
+    if_err_return(rv, cellbuf_init(&global.front, w, h));
     if_err_return(rv, cellbuf_clear(&global.back));
     if_err_return(rv, cellbuf_clear(&global.front));
+    if_err_return(rv,
+        numtab_update(&global.numtab, global.width, global.height));
     return TB_OK;
 }
 
 static int tb_deinit(void) {
+    if (global.wfd_flags >= 0) restore_wfd_flags();
     if (global.caps[0] != NULL && global.wfd >= 0) {
-        bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_EXIT_CA]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_EXIT_KEYPAD]);
-        bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_SHOW_CURSOR]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_SGR0]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_CLEAR_SCREEN]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_EXIT_CA]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_EXIT_KEYPAD]);
+        bytebuf_puts(&enc->out, TB_HARDCAP_EXIT_MOUSE);
+        flush_out();
     }
     if (global.ttyfd >= 0) {
         if (global.has_orig_tios) {
@@ -3192,11 +4477,21 @@ static int tb_deinit(void) {
     sigaction(SIGWINCH, &sa, NULL);
     if (global.resize_pipefd[0] >= 0) close(global.resize_pipefd[0]);
     if (global.resize_pipefd[1] >= 0) close(global.resize_pipefd[1]);
+#ifdef TB_OPT_EPOLL
+    if (global.epfd >= 0) close(global.epfd);
+    if (global.timerfd[0] >= 0) close(global.timerfd[0]);
+    if (global.timerfd[1] >= 0) close(global.timerfd[1]);
+#endif
 
     cellbuf_free(&global.back);
     cellbuf_free(&global.front);
+    cellbuf_free(&global.shown);
+    numtab_free(&global.numtab);
+#ifdef TB_OPT_THREADS
+    workpool_free();
+#endif
     bytebuf_free(&global.in);
-    bytebuf_free(&global.out);
+    bytebuf_free(&enc->out);
 
     if (global.terminfo) tb_free(global.terminfo);
 
@@ -3364,6 +4659,35 @@ static int parse_terminfo_caps(void) {
         global.caps[i] = cap;
     }
 
+    // Extended caps only enable shortcuts, so anything that does not match
+    // the ECMA-48 sequences sent by `send_run` is treated as absent
+    const int bool_bce = 28;
+    if (nbytes_bools > bool_bce &&
+        global.terminfo[nbytes_header + nbytes_names + bool_bce] == 1)
+    {
+        global.extcaps |= TB_EXTCAP_BCE;
+    }
+    static const struct {
+        int16_t index;
+        const char *cap;
+        int extcap;
+    } extcaps[] = {
+        {37,  "\x1b[%p1%dX",              TB_EXTCAP_ECH}, // ech
+        {121, "%p1%c\x1b[%p2%{1}%-%db", TB_EXTCAP_REP}, // rep
+        {6,   "\x1b[K",                   TB_EXTCAP_EL }, // el
+        {110, "\x1b[%p1%dL",              TB_EXTCAP_IL }, // il
+        {106, "\x1b[%p1%dM",              TB_EXTCAP_DL }, // dl
+        {108, "\x1b[%p1%d@",              TB_EXTCAP_ICH}, // ich
+        {105, "\x1b[%p1%dP",              TB_EXTCAP_DCH}, // dch
+    };
+    for (i = 0; i < (int)(sizeof(extcaps) / sizeof(extcaps[0])); i++) {
+        const char *cap = get_terminfo_string(pos_str_offsets, num_offsets,
+            pos_str_table, nbytes_strings, extcaps[i].index);
+        if (cap && strcmp(cap, extcaps[i].cap) == 0) {
+            global.extcaps |= extcaps[i].extcap;
+        }
+    }
+
     return TB_OK;
 }
 
@@ -3379,6 +4703,7 @@ static int load_builtin_caps(void) {
             for (j = 0; j < TB_CAP__COUNT; j++) {
                 global.caps[j] = builtin_terms[i].caps[j];
             }
+            global.extcaps = builtin_terms_extcaps[i];
             return TB_OK;
         }
     }
@@ -3392,6 +4717,7 @@ static int load_builtin_caps(void) {
             for (j = 0; j < TB_CAP__COUNT; j++) {
                 global.caps[j] = builtin_terms[i].caps[j];
             }
+            global.extcaps = builtin_terms_extcaps[i];
             return TB_OK;
         }
     }
@@ -3441,57 +4767,48 @@ static int get_terminfo_int16(int offset, int16_t *val) {
     return TB_OK;
 }
 
-static int wait_event(struct tb_event *event, int timeout) {
+// Wait for an event until `deadline` on `clock`, or forever if it's NULL.
+// The deadline is absolute, so the wakeups for output drains and partial
+// input along the way neither stretch nor shorten the wait: it ends with an
+// event or, once the deadline has passed, with `TB_ERR_NO_EVENT`.
+static int wait_event(struct tb_event *event, clockid_t clock,
+    const struct timespec *deadline) {
     int rv;
     char buf[TB_OPT_READ_BUF];
+    struct wait_ready ready;
 
     memset(event, 0, sizeof(*event));
     if_ok_return(rv, extract_event(event));
 
-    fd_set fds;
-    struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
-
     do {
-        FD_ZERO(&fds);
-        FD_SET(global.rfd, &fds);
-        FD_SET(global.resize_pipefd[0], &fds);
+        if_err_return(rv, wait_fds(clock, deadline, &ready));
 
-        int maxfd = global.resize_pipefd[0] > global.rfd
-                        ? global.resize_pipefd[0]
-                        : global.rfd;
-
-        int select_rv =
-            select(maxfd + 1, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv);
-
-        if (select_rv < 0) {
-            // Let EINTR/EAGAIN bubble up
-            global.last_errno = errno;
-            return TB_ERR_POLL;
-        } else if (select_rv == 0) {
-            return TB_ERR_NO_EVENT;
+        // Queued output drains here, then keep waiting for an actual event
+        if (ready.out) {
+            if_err_return(rv, flush_out());
         }
 
-        int tty_has_events = (FD_ISSET(global.rfd, &fds));
-        int resize_has_events = (FD_ISSET(global.resize_pipefd[0], &fds));
-
-        if (tty_has_events) {
+        if (ready.tty) {
             ssize_t read_rv = read(global.rfd, buf, sizeof(buf));
             if (read_rv < 0) {
                 global.last_errno = errno;
                 return TB_ERR_READ;
-            } else if (read_rv > 0) {
+            } else if (read_rv == 0) {
+                // Readable yet empty: the terminal hung up
+                global.last_errno = EIO;
+                return TB_ERR_READ;
+            } else {
                 bytebuf_nputs(&global.in, buf, read_rv);
             }
         }
 
-        if (resize_has_events) {
+        if (ready.resize) {
             int ignore = 0;
             read(global.resize_pipefd[0], &ignore, sizeof(ignore));
             // TODO: Harden against errors encountered mid-resize
             if_err_return(rv, update_term_size());
-            if_err_return(rv, resize_cellbufs());
+            if_err_return(rv,
+                resize_cellbufs(global.present_mode & TB_PRESENT_KEEP));
             event->type = TB_EVENT_RESIZE;
             event->w = global.width;
             event->h = global.height;
@@ -3500,10 +4817,139 @@ static int wait_event(struct tb_event *event, int timeout) {
 
         memset(event, 0, sizeof(*event));
         if_ok_return(rv, extract_event(event));
-    } while (timeout == -1);
 
-    return rv;
+        // Caller fds come after the tty; they stay readable until read
+        if (ready.fd >= 0) {
+            memset(event, 0, sizeof(*event));
+            event->type = TB_EVENT_FD;
+            event->fd = ready.fd;
+            return TB_OK;
+        }
+    } while (!ready.timeout);
+
+    return TB_ERR_NO_EVENT;
+}
+
+static int wait_fds(clockid_t clock, const struct timespec *deadline,
+    struct wait_ready *ready) {
+#ifdef TB_OPT_EPOLL
+    // There are timers for the two clocks `tb_peek_event_until` documents
+    if (global.epfd >= 0 &&
+        (clock == CLOCK_MONOTONIC || clock == CLOCK_REALTIME))
+    {
+        return wait_fds_epoll(clock, deadline, ready);
+    }
+#endif
+    return wait_fds_select(clock, deadline, ready);
+}
+
+// Wait with `select`, rebuilding the fd sets each time. The time left is
+// worked out afresh from the deadline, rounded up to the microsecond so
+// the wait never ends early.
+static int wait_fds_select(clockid_t clock, const struct timespec *deadline,
+    struct wait_ready *ready) {
+    fd_set fds;
+    fd_set wfds;
+    struct timeval tv;
+    struct timespec now;
+    long long left_us;
+    int i;
+
+    if (deadline) {
+        clock_gettime(clock, &now);
+        left_us = ((long long)(deadline->tv_sec - now.tv_sec) * 1000000000 +
+                      deadline->tv_nsec - now.tv_nsec + 999) /
+                  1000;
+        if (left_us < 0) left_us = 0;
+        tv.tv_sec = left_us / 1000000;
+        tv.tv_usec = left_us % 1000000;
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(global.rfd, &fds);
+    FD_SET(global.resize_pipefd[0], &fds);
+    FD_ZERO(&wfds);
+    if (global.out_pending > 0) FD_SET(global.wfd, &wfds);
+
+    int maxfd = global.resize_pipefd[0] > global.rfd ? global.resize_pipefd[0]
+                                                     : global.rfd;
+    if (global.out_pending > 0 && global.wfd > maxfd) maxfd = global.wfd;
+    for (i = 0; i < global.nextra_fds; i++) {
+        FD_SET(global.extra_fds[i], &fds);
+        if (global.extra_fds[i] > maxfd) maxfd = global.extra_fds[i];
+    }
+
+    int select_rv =
+        select(maxfd + 1, &fds, &wfds, NULL, deadline ? &tv : NULL);
+    if (select_rv < 0) {
+        // Let EINTR/EAGAIN bubble up
+        global.last_errno = errno;
+        return TB_ERR_POLL;
+    }
+
+    memset(ready, 0, sizeof(*ready));
+    ready->fd = -1;
+    ready->timeout = (select_rv == 0);
+    ready->tty = FD_ISSET(global.rfd, &fds);
+    ready->resize = FD_ISSET(global.resize_pipefd[0], &fds);
+    ready->out = global.out_pending > 0 && FD_ISSET(global.wfd, &wfds);
+    for (i = 0; i < global.nextra_fds && ready->fd < 0; i++) {
+        if (FD_ISSET(global.extra_fds[i], &fds)) {
+            ready->fd = global.extra_fds[i];
+        }
+    }
+    return TB_OK;
+}
+
+#ifdef TB_OPT_EPOLL
+// Wait on the persistent epoll instance. The deadline is a timerfd armed
+// on its own clock, so it holds to the nanosecond and needs no re-arming
+// when the wait wakes early.
+static int wait_fds_epoll(clockid_t clock, const struct timespec *deadline,
+    struct wait_ready *ready) {
+    struct epoll_event evs[5 + TB_OPT_EXTRA_FDS];
+    int t = (clock == CLOCK_REALTIME);
+    uint64_t expirations;
+    int rv, i, n;
+
+    if_err_return(rv, arm_timer(!t, NULL));
+    if_err_return(rv, arm_timer(t, deadline));
+    if_err_return(rv, epoll_watch_out(global.out_pending > 0));
+
+    n = epoll_wait(global.epfd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+    if (n < 0) {
+        // Let EINTR bubble up
+        global.last_errno = errno;
+        return TB_ERR_POLL;
+    }
+
+    memset(ready, 0, sizeof(*ready));
+    ready->fd = -1;
+    for (i = 0; i < n; i++) {
+        int fd = evs[i].data.fd;
+        if (fd == global.timerfd[0] || fd == global.timerfd[1]) {
+            // One-shot, so it's disarmed now; a stale one is just drained
+            read(fd, &expirations, sizeof(expirations));
+            global.timer_armed[fd == global.timerfd[1]] = 0;
+            if (fd == global.timerfd[t] && deadline) ready->timeout = 1;
+            continue;
+        }
+        if (fd == global.resize_pipefd[0]) {
+            ready->resize = 1;
+        } else if (fd == global.rfd || fd == global.wfd) {
+            if (fd == global.rfd && (evs[i].events & ~EPOLLOUT)) {
+                ready->tty = 1;
+            }
+            if (fd == global.wfd && (evs[i].events & EPOLLOUT)) {
+                ready->out = 1;
+            }
+        } else if (ready->fd < 0) {
+            ready->fd = fd;
+        }
+    }
+    return TB_OK;
 }
+#endif
 
 static int extract_event(struct tb_event *event) {
     int rv;
@@ -3562,12 +5008,50 @@ static int extract_event(struct tb_event *event) {
 static int extract_esc(struct tb_event *event) {
     int rv;
     if_ok_or_need_more_return(rv, extract_esc_user(event, 0));
+    if_ok_or_need_more_return(rv, extract_esc_mode_report(event));
     if_ok_or_need_more_return(rv, extract_esc_cap(event));
     if_ok_or_need_more_return(rv, extract_esc_mouse(event));
     if_ok_or_need_more_return(rv, extract_esc_user(event, 1));
     return TB_ERR;
 }
 
+// Consume a DEC private mode report, `CSI ? Pd ; Ps $ y`, sent in answer to a
+// mode query, then carry on with whatever input follows it
+static int extract_esc_mode_report(struct tb_event *event) {
+    struct bytebuf *in = &global.in;
+    const char *prefix = "\x1b[?";
+    size_t i, nprefix = strlen(prefix);
+    int field = 0, semis = 0;
+    int nums[2] = {0, 0};
+
+    for (i = 0; i < in->len; i++) {
+        char c = in->buf[i];
+        if (i < nprefix) {
+            if (c != prefix[i]) return TB_ERR;
+        } else if (c >= '0' && c <= '9' && field < 2) {
+            nums[field] = (nums[field] * 10) + (c - '0');
+        } else if (c == ';' && semis == 0) {
+            field = ++semis;
+        } else if (c == '$' && semis == 1 && field < 2) {
+            field = 2;
+        } else if (c == 'y' && field == 2) {
+            break;
+        } else {
+            return TB_ERR;
+        }
+    }
+    if (i >= in->len) return TB_ERR_NEED_MORE;
+
+    // 0 means unrecognized and 4 permanently reset, anything else works
+    if (nums[0] == 2026 && nums[1] >= 1 && nums[1] <= 3) {
+        global.extcaps |= TB_EXTCAP_SYNC;
+    }
+    bytebuf_shift(in, i + 1);
+
+    int rv = extract_event(event);
+    return rv == TB_OK ? TB_OK : TB_ERR_NEED_MORE;
+}
+
 static int extract_esc_user(struct tb_event *event, int is_post) {
     int rv;
     size_t consumed = 0;
@@ -3757,140 +5241,572 @@ static int extract_esc_mouse(struct tb_event *event) {
     return TB_OK;
 }
 
-static int resize_cellbufs(void) {
-    int rv;
-    if_err_return(rv,
-        cellbuf_resize(&global.back, global.width, global.height));
+// Fit the cell buffers to the screen and viewport. Unless `keep` is set,
+// start over from a cleared screen. So is a screen that shrank, as output
+// still on its way for the old size may have wrapped or scrolled it. The
+// clear goes out with the next present.
+static int resize_cellbufs(int keep) {
+    int rv, w, h;
+    if (global.out_held) {
+        // Meant for the old layout, and the front buffer already has it.
+        // The terminal never saw its attributes or moves either.
+        enc->out.len = 0;
+        enc->last_x = -1;
+        enc->last_y = -1;
+        enc->last_fg = ~global.fg;
+        enc->last_bg = ~global.bg;
+        enc->attr_known = 0;
+        global.out_held = 0;
+        keep = 0;
+    }
+    if (keep && global.width >= global.fit_w && global.height >= global.fit_h) {
+        return keep_cellbufs();
+    }
+    global.shown_valid = 0;
+    global.fit_w = global.width;
+    global.fit_h = global.height;
+    viewport_rect(&global.buf_x, &global.buf_y, &w, &h);
+    if_err_return(rv, cellbuf_resize(&global.back, w, h));
+    if_err_return(rv, cellbuf_resize(&global.front, w, h));
+    if_err_return(rv, cellbuf_clear(&global.front));
     if_err_return(rv,
-        cellbuf_resize(&global.front, global.width, global.height));
+        numtab_update(&global.numtab, global.width, global.height));
+    cellbuf_dirty_all(&global.back);
+    if_err_return(rv, queue_clear());
+    return TB_OK;
+}
+
+// Fit the cell buffers like `resize_cellbufs`, but leave the screen alone.
+// The first call since the last present saves what the terminal shows in
+// `shown`, and every call rebuilds the front buffer from it, so the next
+// present only sends cells that differ.
+static int keep_cellbufs(void) {
+    int rv, x, y, w, h;
+    if (!global.shown_valid) {
+        struct cellbuf *shown = &global.shown;
+        struct cellbuf *front = &global.front;
+        if (!shown->cells) {
+            if_err_return(rv, cellbuf_init(shown, front->width, front->height));
+        } else {
+            if_err_return(rv,
+                cellbuf_resize(shown, front->width, front->height));
+        }
+        for (x = 0; x < front->width * front->height; x++) {
+            if_err_return(rv, cell_copy(&shown->cells[x], &front->cells[x]));
+#ifdef TB_OPT_EGC
+            if (front->cells[x].nech > 0) {
+                shown->rows[x / front->width].has_ech = 1;
+            }
+#endif
+        }
+        global.shown_x = global.buf_x;
+        global.shown_y = global.buf_y;
+        global.shown_w = global.fit_w;
+        global.shown_h = global.fit_h;
+        global.shown_valid = 1;
+    }
+    global.fit_w = global.width;
+    global.fit_h = global.height;
+
+    viewport_rect(&global.buf_x, &global.buf_y, &w, &h);
+    if_err_return(rv, cellbuf_resize(&global.back, w, h));
+    if_err_return(rv, cellbuf_resize(&global.front, w, h));
     if_err_return(rv, cellbuf_clear(&global.front));
-    if_err_return(rv, send_clear());
+    if_err_return(rv,
+        numtab_update(&global.numtab, global.width, global.height));
+    cellbuf_dirty_all(&global.back);
+
+    // Outside `shown` the screen is blank, except where it grew since then
+    // and the terminal filled in its own default colors
+    uint32_t invalid = -1;
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            struct tb_cell *cell = &global.front.cells[(y * w) + x];
+            int sx = global.buf_x + x;
+            int sy = global.buf_y + y;
+            struct tb_cell *old = shown_cell_at(sx, sy);
+            if (sx >= global.shown_w || sy >= global.shown_h) {
+                if_err_return(rv, cell_set(cell, &invalid, 1, -1, -1));
+            } else if (old) {
+                if_err_return(rv, cell_copy(cell, old));
+#ifdef TB_OPT_EGC
+                if (old->nech > 0) global.front.rows[y].has_ech = 1;
+#endif
+            }
+        }
+    }
     return TB_OK;
 }
 
-static void handle_resize(int sig) {
-    int errno_copy = errno;
-    write(global.resize_pipefd[1], &sig, sizeof(sig));
-    errno = errno_copy;
+// The `shown` cell at screen position `x, y`, or NULL if it has none
+static struct tb_cell *shown_cell_at(int x, int y) {
+    x -= global.shown_x;
+    y -= global.shown_y;
+    if (!cellbuf_in_bounds(&global.shown, x, y)) return NULL;
+    return &global.shown.cells[(y * global.shown.width) + x];
 }
 
-static int send_attr(uintattr_t fg, uintattr_t bg) {
-    int rv;
+// Bring the screen in line with the front buffer after `keep_cellbufs`.
+// Whichever sends the fewest cells wins, counting about a byte per cell:
+// erasing what was left outside the cell buffers and sending the cells that
+// differ, shifting a moved viewport's old contents into place first, or
+// clearing the screen and sending everything that isn't blank.
+static int present_shown(void) {
+    int rv, i;
+    if (!global.shown_valid) return TB_OK;
+    global.shown_valid = 0;
+
+    struct cellbuf *shown = &global.shown;
+    struct tb_cell blank;
+    memset(&blank, 0, sizeof(blank));
+    blank.ch = ' ';
+    blank.fg = global.fg;
+    blank.bg = global.bg;
+
+    int dx = global.buf_x - global.shown_x;
+    int dy = global.buf_y - global.shown_y;
+    int shift = shift_cost(dx, dy);
+    int keep = count_stale_shown();
+    int redraw = (int)strlen(global.caps[TB_CAP_CLEAR_SCREEN]);
+    int n = global.front.width * global.front.height;
+    for (i = 0; i < n; i++) {
+        struct tb_cell *back = &global.back.cells[i];
+        if (cell_cmp(back, &global.front.cells[i]) != 0) keep++;
+        if (shift >= 0 && cell_cmp(back, &shown->cells[i]) != 0) shift++;
+        if (cell_cmp(back, &blank) != 0) redraw++;
+    }
 
-    if (fg == global.last_fg && bg == global.last_bg) {
-        return TB_OK;
+    if (redraw < keep && (shift < 0 || redraw < shift)) {
+        if_err_return(rv, cellbuf_clear(&global.front));
+        return queue_clear();
     }
+    if (shift < 0 || keep <= shift) return send_erase_shown();
 
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]));
+    if_err_return(rv, send_shift(dx, dy));
+    for (i = 0; i < n; i++) {
+        if_err_return(rv, cell_copy(&global.front.cells[i], &shown->cells[i]));
+#ifdef TB_OPT_EGC
+        if (shown->cells[i].nech > 0) {
+            global.front.rows[i / global.front.width].has_ech = 1;
+        }
+#endif
+    }
+    return TB_OK;
+}
 
-    uint32_t cfg, cbg;
-    switch (global.output_mode) {
-        default:
-        case TB_OUTPUT_NORMAL:
-            // The minus 1 below is because our colors are 1-indexed starting
-            // from black. Black is represented by a 30, 40, 90, or 100 for fg,
-            // bg, bright fg, or bright bg respectively. Red is 31, 41, 91,
-            // 101, etc.
-            cfg = (fg & TB_BRIGHT ? 90 : 30) + (fg & 0x0f) - 1;
-            cbg = (bg & TB_BRIGHT ? 100 : 40) + (bg & 0x0f) - 1;
-            break;
+// Bytes `send_shift` takes to move `shown` by `dx, dy`, or -1 if it can't
+// be done: the viewport changed size, the terminal lacks the sequences, or
+// the cells inserted would not come out blank.
+static int shift_cost(int dx, int dy) {
+    struct cellbuf *shown = &global.shown;
+    int caps = global.extcaps;
+    if (dx == 0 && dy == 0) return -1;
+    if (shown->width != global.front.width ||
+        shown->height != global.front.height)
+    {
+        return -1;
+    }
+    if ((dy > 0 && !(caps & TB_EXTCAP_IL)) ||
+        (dy < 0 && !(caps & TB_EXTCAP_DL)) ||
+        (dx > 0 && !(caps & TB_EXTCAP_ICH)) ||
+        (dx < 0 && !(caps & TB_EXTCAP_DCH)))
+    {
+        return -1;
+    }
+    if (!(caps & TB_EXTCAP_BCE) && !attr_is_default(global.bg)) return -1;
 
-        case TB_OUTPUT_256:
-            cfg = fg & 0xff;
-            cbg = bg & 0xff;
-            if (fg & TB_HI_BLACK) cfg = 0;
-            if (bg & TB_HI_BLACK) cbg = 0;
-            break;
+    int cost = 0;
+    if (dy != 0) {
+        int y = dy > 0 ? global.shown_y : global.buf_y;
+        cost += 8 + num_len(y + 1) + num_len(dy > 0 ? dy : -dy);
+    }
+    if (dx != 0) {
+        int x = dx > 0 ? global.shown_x : global.buf_x;
+        int per_row = 7 + num_len(x + 1) + num_len(dx > 0 ? dx : -dx);
+        int y;
+        for (y = global.buf_y; y < global.buf_y + shown->height; y++) {
+            cost += per_row + num_len(y + 1);
+        }
+    }
+    return cost;
+}
 
-        case TB_OUTPUT_216:
-            cfg = fg & 0xff;
-            cbg = bg & 0xff;
-            if (cfg > 216) cfg = 216;
-            if (cbg > 216) cbg = 216;
-            cfg += 0x0f;
-            cbg += 0x0f;
-            break;
+// Move the screen contents of `shown` by `dx, dy` onto the cell buffers.
+// Whole lines go up or down, dragging along the blank rest of the screen,
+// then each row of the viewport goes left or right.
+static int send_shift(int dx, int dy) {
+    int rv, y;
+    if_err_return(rv, send_attr(global.fg, global.bg));
+    if (dy != 0) {
+        if_err_return(rv,
+            send_cursor_if(0, dy > 0 ? global.shown_y : global.buf_y));
+        send_literal(rv, "\x1b[");
+        send_num(rv, dy > 0 ? dy : -dy);
+        if (dy > 0) {
+            send_literal(rv, "L");
+        } else {
+            send_literal(rv, "M");
+        }
+    }
+    if (dx != 0) {
+        int x = dx > 0 ? global.shown_x : global.buf_x;
+        for (y = global.buf_y; y < global.buf_y + global.shown.height; y++) {
+            if_err_return(rv, send_cursor_if(x, y));
+            send_literal(rv, "\x1b[");
+            send_num(rv, dx > 0 ? dx : -dx);
+            if (dx > 0) {
+                send_literal(rv, "@");
+            } else {
+                send_literal(rv, "P");
+            }
+        }
+    }
+    // Inserting and deleting lines may move the cursor to the left margin
+    enc->last_x = -1;
+    enc->last_y = -1;
+    return TB_OK;
+}
 
-        case TB_OUTPUT_GRAYSCALE:
-            cfg = fg & 0xff;
-            cbg = bg & 0xff;
-            if (cfg > 24) cfg = 24;
-            if (cbg > 24) cbg = 24;
-            cfg += 0xe7;
-            cbg += 0xe7;
-            break;
+// Length of the run of cells from `x` on row `y`, up to `x1`, that `shown`
+// left on screen outside the cell buffers and that aren't blank
+static int stale_run(int x, int y, int x1) {
+    struct tb_cell blank;
+    memset(&blank, 0, sizeof(blank));
+    blank.ch = ' ';
+    blank.fg = global.fg;
+    blank.bg = global.bg;
+
+    int run = 0;
+    while (x + run < x1 && !front_cell_at(x + run, y) &&
+           cell_cmp(shown_cell_at(x + run, y), &blank) != 0)
+    {
+        run++;
+    }
+    return run;
+}
 
-#if TB_OPT_ATTR_W >= 32
-        case TB_OUTPUT_TRUECOLOR:
-            cfg = fg & 0xffffff;
-            cbg = bg & 0xffffff;
-            if (fg & TB_HI_BLACK) cfg = 0;
-            if (bg & TB_HI_BLACK) cbg = 0;
-            break;
-#endif
+// Number of cells `send_erase_shown` would erase
+static int count_stale_shown(void) {
+    int x, y, n = 0;
+    int x1 = global.shown_x + global.shown.width;
+    int y1 = global.shown_y + global.shown.height;
+    for (y = global.shown_y; y < y1; y++) {
+        for (x = global.shown_x; x < x1; x++) {
+            n += stale_run(x, y, x + 1);
+        }
+    }
+    return n;
+}
+
+// Blank out whatever `shown` left on screen outside the cell buffers
+static int send_erase_shown(void) {
+    int rv, i, x, y;
+    struct tb_cell blank;
+    memset(&blank, 0, sizeof(blank));
+    blank.ch = ' ';
+    blank.fg = global.fg;
+    blank.bg = global.bg;
+
+    int x1 = global.shown_x + global.shown.width;
+    int y1 = global.shown_y + global.shown.height;
+    for (y = global.shown_y; y < y1; y++) {
+        for (x = global.shown_x; x < x1;) {
+            int run = stale_run(x, y, x1);
+            if (run == 0) {
+                x++;
+                continue;
+            }
+            if_err_return(rv, send_attr(blank.fg, blank.bg));
+            if ((global.present_mode & TB_PRESENT_RLE) && run > 1) {
+                if_err_return(rv,
+                    send_run(x, y, &blank, run, x + run == global.width));
+            } else {
+                for (i = 0; i < run; i++) {
+                    if_err_return(rv, send_char(x + i, y, ' '));
+                }
+            }
+            x += run;
+        }
+    }
+    return TB_OK;
+}
+
+// The part of the screen the cell buffers cover
+static void viewport_rect(int *x, int *y, int *w, int *h) {
+    int x1 = global.view_x + global.view_w;
+    int y1 = global.view_y + global.view_h;
+    *x = global.view_x > 0 ? global.view_x : 0;
+    *y = global.view_y > 0 ? global.view_y : 0;
+    if (x1 > global.width) x1 = global.width;
+    if (y1 > global.height) y1 = global.height;
+    if (global.view_w <= 0 || global.view_h <= 0 || x1 <= *x || y1 <= *y) {
+        *x = *y = 0;
+        x1 = global.width;
+        y1 = global.height;
     }
+    *w = x1 - *x;
+    *h = y1 - *y;
+}
+
+static void handle_resize(int sig) {
+    int errno_copy = errno;
+    write(global.resize_pipefd[1], &sig, sizeof(sig));
+    errno = errno_copy;
+}
+
+static int send_attr(uintattr_t fg, uintattr_t bg) {
+    int rv;
+
+    if (fg == enc->last_fg && bg == enc->last_bg) {
+        return TB_OK;
+    }
+
+    if (global.sgr_attrs && enc->attr_known) {
+        if_err_return(rv, send_attr_delta(fg, bg));
+        enc->last_fg = fg;
+        enc->last_bg = bg;
+        return TB_OK;
+    }
+
+    if_err_return(rv, bytebuf_puts(&enc->out, global.caps[TB_CAP_SGR0]));
+
+    uint32_t cfg, cbg;
+    attr_colors(fg, bg, &cfg, &cbg);
 
     if (fg & TB_BOLD)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BOLD]));
+        if_err_return(rv, bytebuf_puts(&enc->out, global.caps[TB_CAP_BOLD]));
 
     if (fg & TB_BLINK)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BLINK]));
+        if_err_return(rv, bytebuf_puts(&enc->out, global.caps[TB_CAP_BLINK]));
 
     if (fg & TB_UNDERLINE)
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_UNDERLINE]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_UNDERLINE]));
 
     if (fg & TB_ITALIC)
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_ITALIC]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_ITALIC]));
 
     if (fg & TB_DIM)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_DIM]));
+        if_err_return(rv, bytebuf_puts(&enc->out, global.caps[TB_CAP_DIM]));
 
 #if TB_OPT_ATTR_W == 64
     if (fg & TB_STRIKEOUT)
-        if_err_return(rv, bytebuf_puts(&global.out, TB_HARDCAP_STRIKEOUT));
+        if_err_return(rv, bytebuf_puts(&enc->out, TB_HARDCAP_STRIKEOUT));
 
     if (fg & TB_UNDERLINE_2)
-        if_err_return(rv, bytebuf_puts(&global.out, TB_HARDCAP_UNDERLINE_2));
+        if_err_return(rv, bytebuf_puts(&enc->out, TB_HARDCAP_UNDERLINE_2));
 
     if (fg & TB_OVERLINE)
-        if_err_return(rv, bytebuf_puts(&global.out, TB_HARDCAP_OVERLINE));
+        if_err_return(rv, bytebuf_puts(&enc->out, TB_HARDCAP_OVERLINE));
 
     if (fg & TB_INVISIBLE)
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_INVISIBLE]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_INVISIBLE]));
 #endif
 
     if ((fg & TB_REVERSE) || (bg & TB_REVERSE))
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_REVERSE]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_REVERSE]));
+
+    int fg_is_default = attr_is_default(fg);
+    int bg_is_default = attr_is_default(bg);
+
+    if_err_return(rv, send_sgr(cfg, cbg, fg_is_default, bg_is_default));
+
+    enc->last_fg = fg;
+    enc->last_bg = bg;
+    enc->attr_known = 1;
+
+    return TB_OK;
+}
+
+static void attr_colors(uintattr_t fg, uintattr_t bg, uint32_t *cfg,
+    uint32_t *cbg) {
+    switch (global.output_mode) {
+        default:
+        case TB_OUTPUT_NORMAL:
+            // The minus 1 below is because our colors are 1-indexed starting
+            // from black. Black is represented by a 30, 40, 90, or 100 for fg,
+            // bg, bright fg, or bright bg respectively. Red is 31, 41, 91,
+            // 101, etc.
+            *cfg = (fg & TB_BRIGHT ? 90 : 30) + (fg & 0x0f) - 1;
+            *cbg = (bg & TB_BRIGHT ? 100 : 40) + (bg & 0x0f) - 1;
+            break;
+
+        case TB_OUTPUT_256:
+            *cfg = fg & 0xff;
+            *cbg = bg & 0xff;
+            if (fg & TB_HI_BLACK) *cfg = 0;
+            if (bg & TB_HI_BLACK) *cbg = 0;
+            break;
+
+        case TB_OUTPUT_216:
+            *cfg = fg & 0xff;
+            *cbg = bg & 0xff;
+            if (*cfg > 216) *cfg = 216;
+            if (*cbg > 216) *cbg = 216;
+            *cfg += 0x0f;
+            *cbg += 0x0f;
+            break;
+
+        case TB_OUTPUT_GRAYSCALE:
+            *cfg = fg & 0xff;
+            *cbg = bg & 0xff;
+            if (*cfg > 24) *cfg = 24;
+            if (*cbg > 24) *cbg = 24;
+            *cfg += 0xe7;
+            *cbg += 0xe7;
+            break;
 
-    int fg_is_default = (fg & 0xff) == 0;
-    int bg_is_default = (bg & 0xff) == 0;
-    if (global.output_mode == TB_OUTPUT_256) {
-        if (fg & TB_HI_BLACK) fg_is_default = 0;
-        if (bg & TB_HI_BLACK) bg_is_default = 0;
-    }
 #if TB_OPT_ATTR_W >= 32
-    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
-        fg_is_default = ((fg & 0xffffff) == 0) && ((fg & TB_HI_BLACK) == 0);
-        bg_is_default = ((bg & 0xffffff) == 0) && ((bg & TB_HI_BLACK) == 0);
+        case TB_OUTPUT_TRUECOLOR:
+            *cfg = fg & 0xffffff;
+            *cbg = bg & 0xffffff;
+            if (fg & TB_HI_BLACK) *cfg = 0;
+            if (bg & TB_HI_BLACK) *cbg = 0;
+            break;
+#endif
     }
+}
+
+// Send the change from the last attributes to `fg, bg` as one SGR, either as
+// a delta or as a reset followed by everything set, whichever is shorter
+static int send_attr_delta(uintattr_t fg, uintattr_t bg) {
+    int rv;
+    size_t start = enc->out.len;
+
+    if_err_return(rv, send_sgr_attrs(0, 0, 1, fg, bg));
+    size_t reset_len = enc->out.len - start;
+    if_err_return(rv,
+        send_sgr_attrs(enc->last_fg, enc->last_bg, 0, fg, bg));
+    size_t delta_len = enc->out.len - start - reset_len;
+
+    if (delta_len < reset_len) {
+        memmove(enc->out.buf + start, enc->out.buf + start + reset_len,
+            delta_len);
+        enc->out.len = start + delta_len;
+    } else {
+        enc->out.len = start + reset_len;
+    }
+    enc->out.buf[enc->out.len] = '\0';
+    return TB_OK;
+}
+
+static int send_sgr_attrs(uintattr_t from_fg, uintattr_t from_bg, int reset,
+    uintattr_t fg, uintattr_t bg) {
+    // Codes that share an "off" code turn each other off too
+    static const struct {
+        uintattr_t attr;
+        uint32_t on;
+        uint32_t off;
+    } styles[] = {
+        {TB_BOLD, 1, 22},
+        {TB_DIM, 2, 22},
+        {TB_ITALIC, 3, 23},
+        {TB_UNDERLINE, 4, 24},
+        {TB_BLINK, 5, 25},
+        {TB_REVERSE, 7, 27},
+#if TB_OPT_ATTR_W == 64
+        {TB_INVISIBLE, 8, 28},
+        {TB_STRIKEOUT, 9, 29},
+        {TB_UNDERLINE_2, 21, 24},
+        {TB_OVERLINE, 53, 55},
 #endif
+    };
+    size_t nstyles = sizeof(styles) / sizeof(styles[0]);
+    int rv, nparams = 0;
+    size_t i, j;
 
-    if_err_return(rv, send_sgr(cfg, cbg, fg_is_default, bg_is_default));
+    if (reset) {
+        if_err_return(rv, send_sgr_param(&nparams, 0));
+        from_fg = from_bg = 0;
+    }
+
+    // Reverse may be set on either side, so fold it into the style bits
+    uintattr_t was = (from_fg | (from_bg & TB_REVERSE)) & global.sgr_attrs;
+    uintattr_t now = (fg | (bg & TB_REVERSE)) & global.sgr_attrs;
+
+    for (i = 0; i < nstyles; i++) {
+        if (!(was & styles[i].attr) || (now & styles[i].attr)) continue;
+        if_err_return(rv, send_sgr_param(&nparams, styles[i].off));
+        for (j = 0; j < nstyles; j++) {
+            if (styles[j].off == styles[i].off) was &= ~styles[j].attr;
+        }
+    }
+    for (i = 0; i < nstyles; i++) {
+        if (!(now & styles[i].attr) || (was & styles[i].attr)) continue;
+        if_err_return(rv, send_sgr_param(&nparams, styles[i].on));
+    }
 
-    global.last_fg = fg;
-    global.last_bg = bg;
+    uint32_t cfg, cbg, from_cfg, from_cbg;
+    attr_colors(fg, bg, &cfg, &cbg);
+    attr_colors(from_fg, from_bg, &from_cfg, &from_cbg);
+    int fg_is_default = attr_is_default(fg);
+    int bg_is_default = attr_is_default(bg);
+    int from_fg_is_default = reset || attr_is_default(from_fg);
+    int from_bg_is_default = reset || attr_is_default(from_bg);
+
+    if (fg_is_default != from_fg_is_default ||
+        (!fg_is_default && cfg != from_cfg))
+    {
+        if_err_return(rv, send_sgr_color(&nparams, cfg, fg_is_default, 0));
+    }
+    if (bg_is_default != from_bg_is_default ||
+        (!bg_is_default && cbg != from_cbg))
+    {
+        if_err_return(rv, send_sgr_color(&nparams, cbg, bg_is_default, 1));
+    }
+
+    if (nparams > 0) send_literal(rv, "m");
+    return TB_OK;
+}
 
+static int send_sgr_param(int *nparams, uint32_t num) {
+    int rv;
+    if (*nparams == 0) {
+        send_literal(rv, "\x1b[");
+    } else {
+        send_literal(rv, ";");
+    }
+    send_num(rv, num);
+    (*nparams)++;
     return TB_OK;
 }
 
+static int send_sgr_color(int *nparams, uint32_t c, int is_default,
+    int is_bg) {
+    int rv;
+    uint32_t base = is_bg ? 48 : 38;
+
+    if (is_default) return send_sgr_param(nparams, base + 1);
+
+    switch (global.output_mode) {
+        default:
+        case TB_OUTPUT_NORMAL:
+            return send_sgr_param(nparams, c);
+
+        case TB_OUTPUT_256:
+        case TB_OUTPUT_216:
+        case TB_OUTPUT_GRAYSCALE:
+            if_err_return(rv, send_sgr_param(nparams, base));
+            if_err_return(rv, send_sgr_param(nparams, 5));
+            return send_sgr_param(nparams, c);
+
+#if TB_OPT_ATTR_W >= 32
+        case TB_OUTPUT_TRUECOLOR:
+            if_err_return(rv, send_sgr_param(nparams, base));
+            if_err_return(rv, send_sgr_param(nparams, 2));
+            if_err_return(rv, send_sgr_param(nparams, (c >> 16) & 0xff));
+            if_err_return(rv, send_sgr_param(nparams, (c >> 8) & 0xff));
+            return send_sgr_param(nparams, c & 0xff);
+#endif
+    }
+}
+
 static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
     int bg_is_default) {
     int rv;
-    char nbuf[32];
 
     if (fg_is_default && bg_is_default) {
         return TB_OK;
@@ -3901,13 +5817,13 @@ static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
         case TB_OUTPUT_NORMAL:
             send_literal(rv, "\x1b[");
             if (!fg_is_default) {
-                send_num(rv, nbuf, cfg);
+                send_num(rv, cfg);
                 if (!bg_is_default) {
                     send_literal(rv, ";");
                 }
             }
             if (!bg_is_default) {
-                send_num(rv, nbuf, cbg);
+                send_num(rv, cbg);
             }
             send_literal(rv, "m");
             break;
@@ -3918,14 +5834,14 @@ static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
             send_literal(rv, "\x1b[");
             if (!fg_is_default) {
                 send_literal(rv, "38;5;");
-                send_num(rv, nbuf, cfg);
+                send_num(rv, cfg);
                 if (!bg_is_default) {
                     send_literal(rv, ";");
                 }
             }
             if (!bg_is_default) {
                 send_literal(rv, "48;5;");
-                send_num(rv, nbuf, cbg);
+                send_num(rv, cbg);
             }
             send_literal(rv, "m");
             break;
@@ -3935,22 +5851,22 @@ static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
             send_literal(rv, "\x1b[");
             if (!fg_is_default) {
                 send_literal(rv, "38;2;");
-                send_num(rv, nbuf, (cfg >> 16) & 0xff);
+                send_num(rv, (cfg >> 16) & 0xff);
                 send_literal(rv, ";");
-                send_num(rv, nbuf, (cfg >> 8) & 0xff);
+                send_num(rv, (cfg >> 8) & 0xff);
                 send_literal(rv, ";");
-                send_num(rv, nbuf, cfg & 0xff);
+                send_num(rv, cfg & 0xff);
                 if (!bg_is_default) {
                     send_literal(rv, ";");
                 }
             }
             if (!bg_is_default) {
                 send_literal(rv, "48;2;");
-                send_num(rv, nbuf, (cbg >> 16) & 0xff);
+                send_num(rv, (cbg >> 16) & 0xff);
                 send_literal(rv, ";");
-                send_num(rv, nbuf, (cbg >> 8) & 0xff);
+                send_num(rv, (cbg >> 8) & 0xff);
                 send_literal(rv, ";");
-                send_num(rv, nbuf, cbg & 0xff);
+                send_num(rv, cbg & 0xff);
             }
             send_literal(rv, "m");
             break;
@@ -3961,15 +5877,23 @@ static int send_sgr(uint32_t cfg, uint32_t cbg, int fg_is_default,
 
 static int send_cursor_if(int x, int y) {
     int rv;
-    char nbuf[32];
     if (x < 0 || y < 0) {
         return TB_OK;
     }
-    send_literal(rv, "\x1b[");
-    send_num(rv, nbuf, y + 1);
-    send_literal(rv, ";");
-    send_num(rv, nbuf, x + 1);
-    send_literal(rv, "H");
+    if (y < global.numtab.nrows && x < global.numtab.ncols) {
+        struct numstr *row = &global.numtab.cup_rows[y];
+        struct numstr *col = &global.numtab.cup_cols[x];
+        if_err_return(rv, bytebuf_nputs(&enc->out, row->buf, row->len));
+        if_err_return(rv, bytebuf_nputs(&enc->out, col->buf, col->len));
+    } else {
+        send_literal(rv, "\x1b[");
+        send_num(rv, y + 1);
+        send_literal(rv, ";");
+        send_num(rv, x + 1);
+        send_literal(rv, "H");
+    }
+    enc->last_x = x - 1;
+    enc->last_y = y;
     return TB_OK;
 }
 
@@ -3981,11 +5905,18 @@ static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
     int rv;
     char chu8[8];
 
-    if (global.last_x != x - 1 || global.last_y != y) {
-        if_err_return(rv, send_cursor_if(x, y));
+    if (enc->last_x != x - 1 || enc->last_y != y) {
+        if_err_return(rv, send_move(x, y));
+    }
+    enc->last_x = x;
+    enc->last_y = y;
+
+    // The terminal may not agree on how far a wide char moves the cursor,
+    // so only trust the position again after the next absolute move
+    if (tb_wcswidth(ch, nch) != 1) {
+        enc->last_x = -1;
+        enc->last_y = -1;
     }
-    global.last_x = x;
-    global.last_y = y;
 
     int i;
     for (i = 0; i < (int)nch; i++) {
@@ -3994,12 +5925,342 @@ static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
             ch32 = 0xfffd; // replace non-printable codepoints with U+FFFD
         }
         int chu8_len = tb_utf8_unicode_to_char(chu8, ch32);
-        if_err_return(rv, bytebuf_nputs(&global.out, chu8, (size_t)chu8_len));
+        if_err_return(rv, bytebuf_nputs(&enc->out, chu8, (size_t)chu8_len));
+    }
+
+    return TB_OK;
+}
+
+static int send_run(int x, int y, struct tb_cell *cell, int n, int eol) {
+    int rv, i;
+
+    uint32_t ch = cell->ch;
+    if (!tb_iswprint(ch)) {
+        ch = 0xfffd; // replace non-printable codepoints with U+FFFD
+    }
+
+    // Erasing leaves the cursor at `x`, so unless the line is done the next
+    // cell will likely need a cursor move past the run
+    size_t cost_move = eol ? 0 : move_rel_cost(n);
+    int how = pick_run(cell, ch, n, eol, cost_move);
+
+    switch (how) {
+        case TB_RUN_PLAIN:
+            for (i = 0; i < n; i++) {
+                if_err_return(rv, send_char(x + i, y, ch));
+            }
+            break;
+        case TB_RUN_REP:
+            if_err_return(rv, send_char(x, y, ch));
+            send_literal(rv, "\x1b[");
+            send_num(rv, n - 1);
+            send_literal(rv, "b");
+            enc->last_x = x + n - 1;
+            break;
+        case TB_RUN_ECH:
+        case TB_RUN_EL:
+            if (enc->last_x != x - 1 || enc->last_y != y) {
+                if_err_return(rv, send_move(x, y));
+            }
+            if (how == TB_RUN_EL) {
+                send_literal(rv, "\x1b[K");
+            } else {
+                send_literal(rv, "\x1b[");
+                send_num(rv, n);
+                send_literal(rv, "X");
+            }
+            // The cursor did not move
+            enc->last_x = x - 1;
+            enc->last_y = y;
+            break;
     }
 
     return TB_OK;
 }
 
+static int pick_run(struct tb_cell *cell, uint32_t ch, int n, int eol,
+    size_t cost_move) {
+    char chu8[8];
+    size_t chu8_len = (size_t)tb_utf8_unicode_to_char(chu8, ch);
+
+    // An erased cell is a plain space in the current background, or in the
+    // default background if the terminal lacks bce
+    int erasable = ch == ' ' && ((cell->fg | cell->bg) & TB_STYLE_MASK) == 0 &&
+                   ((global.extcaps & TB_EXTCAP_BCE) || attr_is_default(cell->bg));
+
+    size_t cost_plain = chu8_len * n;
+    size_t cost_rep = chu8_len + 3 + num_len(n - 1);
+    size_t cost_ech = 3 + num_len(n) + cost_move;
+    size_t cost_el = 3;
+
+    int how = TB_RUN_PLAIN;
+    size_t cost = cost_plain;
+    if ((global.extcaps & TB_EXTCAP_REP) && cost_rep < cost) {
+        how = TB_RUN_REP;
+        cost = cost_rep;
+    }
+    if (erasable && (global.extcaps & TB_EXTCAP_ECH) && cost_ech < cost) {
+        how = TB_RUN_ECH;
+        cost = cost_ech;
+    }
+    if (erasable && eol && (global.extcaps & TB_EXTCAP_EL) && cost_el < cost) {
+        how = TB_RUN_EL;
+    }
+    return how;
+}
+
+// Move the cursor by `n` cells with `CUU`/`CUD`/`CUF`/`CUB` (`dir` is the
+// final byte), leaving out the count when it is 1
+static int send_move_rel(int n, char dir) {
+    int rv;
+    if (n <= 0) return TB_OK;
+    if_err_return(rv, bytebuf_puts(&enc->out, "\x1b["));
+    if (n > 1) {
+        if_err_return(rv, send_number(n));
+    }
+    return bytebuf_nputs(&enc->out, &dir, 1);
+}
+
+static size_t move_rel_cost(int n) {
+    if (n <= 0) return 0;
+    return n > 1 ? 3 + (size_t)num_len(n) : 3;
+}
+
+// Cost of moving `n` cells down or left, where repeating `LF` or `BS` (one
+// byte each) may beat `CUD`/`CUB`. The tty is in raw mode, so `LF` does not
+// return the carriage.
+static size_t move_step_cost(int n) {
+    size_t cost = move_rel_cost(n);
+    return (size_t)n < cost ? (size_t)n : cost;
+}
+
+// The front buffer cell shown at screen position `x, y`, or NULL if the cell
+// buffers don't cover it
+static struct tb_cell *front_cell_at(int x, int y) {
+    x -= global.buf_x;
+    y -= global.buf_y;
+    if (!cellbuf_in_bounds(&global.front, x, y)) return NULL;
+    return &global.front.cells[(y * global.front.width) + x];
+}
+
+// Cost of stepping right from `x0` to `x` on row `y` by printing again what
+// the front buffer says is already there. Only plain single-width cells in
+// the current attributes qualify, otherwise this returns `SIZE_MAX`.
+static size_t reprint_cost(int x0, int x, int y) {
+    char chu8[8];
+    size_t cost = 0;
+    int i, w;
+    if (x - x0 > TB_REPRINT_MAX) return SIZE_MAX;
+    struct tb_cell *cell = front_cell_at(x0, y);
+    if (!cell || !front_cell_at(x - 1, y)) return SIZE_MAX;
+    for (i = x0; i < x; i++, cell++) {
+        if (cell->fg != enc->last_fg || cell->bg != enc->last_bg) {
+            return SIZE_MAX;
+        }
+#ifdef TB_OPT_EGC
+        if (cell->nech > 0) return SIZE_MAX;
+#endif
+        if (!tb_iswprint_ex(cell->ch, &w) || w != 1) return SIZE_MAX;
+        cost += (size_t)tb_utf8_unicode_to_char(chu8, cell->ch);
+    }
+    return cost;
+}
+
+// Cost of moving the cursor to `x, y` from where the last write left it, and
+// which way (`TB_MOVE_*`) to get there cheapest
+static size_t move_cost(int x, int y, int *how) {
+    int cx = enc->last_x + 1;
+    int cy = enc->last_y;
+
+    *how = TB_MOVE_CUP;
+    size_t best = 4 + (size_t)num_len(y + 1) + (size_t)num_len(x + 1);
+    if (cy < 0) return best;
+
+    size_t vert = y > cy ? move_step_cost(y - cy) : move_rel_cost(cy - y);
+
+    // A cursor past the last column is waiting to wrap, and only `CR` is
+    // sure to put it back somewhere known
+    if (cx < global.width) {
+        size_t horz = x >= cx ? move_rel_cost(x - cx) : move_step_cost(cx - x);
+        if (x > cx) {
+            size_t reprint = reprint_cost(cx, x, y);
+            if (reprint < horz) horz = reprint;
+        }
+        if (vert + horz < best) {
+            *how = TB_MOVE_REL;
+            best = vert + horz;
+        }
+    }
+
+    size_t horz = move_rel_cost(x);
+    size_t reprint = reprint_cost(0, x, y);
+    if (reprint < horz) horz = reprint;
+    if (1 + vert + horz < best) {
+        *how = TB_MOVE_CR;
+        best = 1 + vert + horz;
+    }
+    return best;
+}
+
+static int send_move(int x, int y) {
+    int rv, how;
+    move_cost(x, y, &how);
+
+    int cx = enc->last_x + 1;
+    int cy = enc->last_y;
+    switch (how) {
+        case TB_MOVE_CUP:
+            return send_cursor_if(x, y);
+        case TB_MOVE_CR:
+            send_literal(rv, "\r");
+            cx = 0;
+            break;
+    }
+    if_err_return(rv, send_move_down(y - cy));
+    if_err_return(rv, send_move_rel(cy - y, 'A'));
+    if_err_return(rv, send_move_fwd(cx, x, y));
+    if_err_return(rv, send_move_back(cx - x));
+    enc->last_x = x - 1;
+    enc->last_y = y;
+    return TB_OK;
+}
+
+static int send_move_down(int n) {
+    int rv;
+    if (n <= 0) return TB_OK;
+    if (move_rel_cost(n) <= (size_t)n) return send_move_rel(n, 'B');
+    while (n-- > 0) send_literal(rv, "\n");
+    return TB_OK;
+}
+
+static int send_move_back(int n) {
+    int rv;
+    if (n <= 0) return TB_OK;
+    if (move_rel_cost(n) <= (size_t)n) return send_move_rel(n, 'D');
+    while (n-- > 0) send_literal(rv, "\b");
+    return TB_OK;
+}
+
+// Step right from `x0` to `x` on row `y` with `CUF` or by reprinting, as
+// decided by `reprint_cost`. Only valid once the cursor is on row `y`.
+static int send_move_fwd(int x0, int x, int y) {
+    int rv;
+    char chu8[8];
+    if (x <= x0) return TB_OK;
+    if (reprint_cost(x0, x, y) >= move_rel_cost(x - x0)) {
+        return send_move_rel(x - x0, 'C');
+    }
+    struct tb_cell *cell = front_cell_at(x0, y);
+    for (; x0 < x; x0++, cell++) {
+        int chu8_len = tb_utf8_unicode_to_char(chu8, cell->ch);
+        if_err_return(rv, bytebuf_nputs(&enc->out, chu8, (size_t)chu8_len));
+    }
+    return TB_OK;
+}
+
+// Encode a sprite with relative cursor moves only, starting at its first
+// opaque cell with that cell's attributes already in effect
+static int sprite_encode(struct tb_sprite *sp) {
+    int rv = TB_OK;
+    char chu8[8];
+
+    struct bytebuf saved_out = enc->out;
+    uintattr_t saved_fg = enc->last_fg;
+    uintattr_t saved_bg = enc->last_bg;
+    int saved_known = enc->attr_known;
+    memset(&enc->out, 0, sizeof(enc->out));
+
+    int cx = -1, cy = -1; // cursor relative to the block, -1 before start
+    int x, y, n, k;
+    sp->start_x = sp->start_y = 0;
+    for (y = 0; y < sp->h && rv == TB_OK; y++) {
+        for (x = 0; x < sp->w && rv == TB_OK; x += n) {
+            struct tb_cell *cell = &sp->cells[(y * sp->w) + x];
+            n = 1;
+            if (cell->ch == 0) continue;
+            if (global.present_mode & TB_PRESENT_RLE) {
+                while (x + n < sp->w && cell_cmp(cell + n, cell) == 0) n++;
+            }
+
+            if (cx < 0) {
+                sp->start_x = cx = x;
+                sp->start_y = cy = y;
+                enc->last_fg = cell->fg;
+                enc->last_bg = cell->bg;
+                enc->attr_known = 1;
+            }
+            if_err_break(rv, send_move_down(y - cy));
+            if_err_break(rv, send_move_rel(x - cx, 'C'));
+            if_err_break(rv, send_move_back(cx - x));
+            cx = x;
+            cy = y;
+            if_err_break(rv, send_attr(cell->fg, cell->bg));
+
+            uint32_t ch = cell->ch;
+            if (!tb_iswprint(ch)) ch = 0xfffd;
+            int chu8_len = tb_utf8_unicode_to_char(chu8, ch);
+
+            // Erasing leaves the cursor in place, assume it has to move on
+            int how = n > 1 ? pick_run(cell, ch, n, 0, 3 + num_len(n))
+                            : TB_RUN_PLAIN;
+            switch (how) {
+                case TB_RUN_REP:
+                    if_err_break(rv,
+                        bytebuf_nputs(&enc->out, chu8, (size_t)chu8_len));
+                    if_err_break(rv, bytebuf_puts(&enc->out, "\x1b["));
+                    if_err_break(rv, send_number(n - 1));
+                    if_err_break(rv, bytebuf_puts(&enc->out, "b"));
+                    cx += n;
+                    break;
+                case TB_RUN_ECH:
+                    if_err_break(rv, bytebuf_puts(&enc->out, "\x1b["));
+                    if_err_break(rv, send_number(n));
+                    if_err_break(rv, bytebuf_puts(&enc->out, "X"));
+                    break;
+                default:
+                    for (k = 0; k < n && rv == TB_OK; k++) {
+                        rv = bytebuf_nputs(&enc->out, chu8,
+                            (size_t)chu8_len);
+                    }
+                    cx += n;
+                    break;
+            }
+        }
+    }
+
+    if (rv == TB_OK) {
+        if (sp->buf) tb_free(sp->buf);
+        sp->buf = enc->out.buf;
+        sp->nbuf = enc->out.len;
+        sp->end_x = cx;
+        sp->end_y = cy;
+        sp->end_fg = enc->last_fg;
+        sp->end_bg = enc->last_bg;
+        sp->output_mode = global.output_mode;
+        sp->present_mode = global.present_mode;
+    } else {
+        bytebuf_free(&enc->out);
+    }
+
+    enc->out = saved_out;
+    enc->last_fg = saved_fg;
+    enc->last_bg = saved_bg;
+    enc->attr_known = saved_known;
+    return rv;
+}
+
+static int attr_is_default(uintattr_t attr) {
+#if TB_OPT_ATTR_W >= 32
+    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
+        return ((attr & 0xffffff) == 0) && ((attr & TB_HI_BLACK) == 0);
+    }
+#endif
+    if (global.output_mode == TB_OUTPUT_256 && (attr & TB_HI_BLACK)) {
+        return 0;
+    }
+    return (attr & 0xff) == 0;
+}
+
 static int convert_num(uint32_t num, char *buf) {
     int i, l = 0;
     char ch;
@@ -4015,6 +6276,69 @@ static int convert_num(uint32_t num, char *buf) {
     return l;
 }
 
+static int send_number(uint32_t num) {
+    char nbuf[32];
+    if (num < (uint32_t)global.numtab.nnums) {
+        struct numstr *str = &global.numtab.nums[num];
+        return bytebuf_nputs(&enc->out, str->buf, str->len);
+    }
+    return bytebuf_nputs(&enc->out, nbuf, convert_num(num, nbuf));
+}
+
+// Make sure the tables cover a `w` by `h` screen, and every number that may
+// show up in a sequence for it: colors, counts and positions
+static int numtab_update(struct numtab *t, int w, int h) {
+    int rv;
+    int want = 256;
+    if (w + 2 > want) want = w + 2;
+    if (h + 2 > want) want = h + 2;
+    if_err_return(rv, numtab_grow(&t->nums, &t->nnums, want, "", 0, 0));
+    if_err_return(rv,
+        numtab_grow(&t->cup_rows, &t->nrows, h, "\x1b[", 1, ';'));
+    if_err_return(rv, numtab_grow(&t->cup_cols, &t->ncols, w, "", 1, 'H'));
+    return TB_OK;
+}
+
+// Grow `tab` to `want` entries of `pre`, the index plus `offset`, then `post`
+// unless it is 0
+static int numtab_grow(struct numstr **tab, int *n, int want,
+    const char *pre, int offset, char post) {
+    if (want <= *n) return TB_OK;
+    struct numstr *grown = (struct numstr *)tb_realloc(*tab,
+        sizeof(struct numstr) * (size_t)want);
+    if (!grown) return TB_ERR_MEM;
+    *tab = grown;
+
+    size_t npre = strlen(pre);
+    int i;
+    for (i = *n; i < want; i++) {
+        struct numstr *str = &grown[i];
+        memcpy(str->buf, pre, npre);
+        size_t len = npre + (size_t)convert_num((uint32_t)(i + offset),
+                                                str->buf + npre);
+        if (post) str->buf[len++] = post;
+        str->len = (unsigned char)len;
+    }
+    *n = want;
+    return TB_OK;
+}
+
+static void numtab_free(struct numtab *t) {
+    if (t->nums) tb_free(t->nums);
+    if (t->cup_rows) tb_free(t->cup_rows);
+    if (t->cup_cols) tb_free(t->cup_cols);
+    memset(t, 0, sizeof(*t));
+}
+
+static int num_len(uint32_t num) {
+    int l = 1;
+    while (num >= 10) {
+        num /= 10;
+        l++;
+    }
+    return l;
+}
+
 static int cell_cmp(struct tb_cell *a, struct tb_cell *b) {
     if (a->ch != b->ch || a->fg != b->fg || a->bg != b->bg) {
         return 1;
@@ -4029,6 +6353,52 @@ static int cell_cmp(struct tb_cell *a, struct tb_cell *b) {
     return 0;
 }
 
+// Return the number of leading cells in `a` and `b` that are bytewise equal,
+// comparing 16 or 32 bytes at a time where SSE2 or AVX2 is available. Equal
+// bytes imply equal cells. The converse does not hold with `TB_OPT_EGC` (the
+// `ech` pointers differ) or with padded cells, so callers still `cell_cmp` the
+// cell this stops at.
+static int cell_skip_same(struct tb_cell *a, struct tb_cell *b, int n) {
+    const unsigned char *pa = (const unsigned char *)a;
+    const unsigned char *pb = (const unsigned char *)b;
+    size_t nbytes = (size_t)n * sizeof(struct tb_cell);
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= nbytes; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(pa + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(pb + i));
+        uint32_t diff =
+            ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (diff) {
+            i += (size_t)__builtin_ctz(diff);
+            return (int)(i / sizeof(struct tb_cell));
+        }
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; i + 16 <= nbytes; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(pa + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(pb + i));
+        uint32_t diff =
+            ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+        if (diff) {
+            i += (size_t)__builtin_ctz(diff);
+            return (int)(i / sizeof(struct tb_cell));
+        }
+    }
+#else
+    const size_t block = 16 * sizeof(struct tb_cell);
+    while (i + block <= nbytes && memcmp(pa + i, pb + i, block) == 0) {
+        i += block;
+    }
+#endif
+    while (i < nbytes && pa[i] == pb[i]) {
+        i++;
+    }
+    return (int)(i / sizeof(struct tb_cell));
+}
+
 static int cell_copy(struct tb_cell *dst, struct tb_cell *src) {
 #ifdef TB_OPT_EGC
     if (src->nech > 0) {
@@ -4087,8 +6457,14 @@ static int cellbuf_init(struct cellbuf *c, int w, int h) {
     c->cells = (struct tb_cell *)tb_malloc(sizeof(struct tb_cell) * w * h);
     if (!c->cells) return TB_ERR_MEM;
     memset(c->cells, 0, sizeof(struct tb_cell) * w * h);
+    c->rows = (struct cellbuf_row *)tb_malloc(sizeof(struct cellbuf_row) * h);
+    if (!c->rows) return TB_ERR_MEM;
+    memset(c->rows, 0, sizeof(struct cellbuf_row) * h);
     c->width = w;
     c->height = h;
+    c->cap = w * h;
+    c->rows_cap = h;
+    cellbuf_dirty_all(c);
     return TB_OK;
 }
 
@@ -4100,17 +6476,49 @@ static int cellbuf_free(struct cellbuf *c) {
         }
         tb_free(c->cells);
     }
+    if (c->rows) tb_free(c->rows);
     memset(c, 0, sizeof(*c));
     return TB_OK;
 }
 
 static int cellbuf_clear(struct cellbuf *c) {
-    int rv, i;
-    uint32_t space = (uint32_t)' ';
-    for (i = 0; i < c->width * c->height; i++) {
-        if_err_return(rv,
-            cell_set(&c->cells[i], &space, 1, global.fg, global.bg));
+    int x, y;
+    struct tb_cell blank;
+    memset(&blank, 0, sizeof(blank));
+    blank.ch = ' ';
+    blank.fg = global.fg;
+    blank.bg = global.bg;
+
+    // Fill one row by doubling and copy it over the others. Rows holding
+    // cluster buffers are reset field by field instead, so the buffers stay
+    // with their cells for reuse.
+    struct tb_cell *tmpl = NULL;
+    for (y = 0; y < c->height; y++) {
+        struct tb_cell *row = &c->cells[y * c->width];
+        c->rows[y].has_wide = 0;
+#ifdef TB_OPT_EGC
+        if (c->rows[y].has_ech) {
+            for (x = 0; x < c->width; x++) {
+                row[x].ch = blank.ch;
+                row[x].fg = blank.fg;
+                row[x].bg = blank.bg;
+                row[x].nech = 0;
+            }
+            continue;
+        }
+#endif
+        if (tmpl) {
+            memcpy(row, tmpl, sizeof(*row) * c->width);
+            continue;
+        }
+        row[0] = blank;
+        for (x = 1; x < c->width; x *= 2) {
+            int n = (x * 2 <= c->width) ? x : c->width - x;
+            memcpy(&row[x], row, sizeof(*row) * n);
+        }
+        tmpl = row;
     }
+    cellbuf_dirty_all(c);
     return TB_OK;
 }
 
@@ -4147,26 +6555,92 @@ static int cellbuf_resize(struct cellbuf *c, int w, int h) {
     int minw = (w < ow) ? w : ow;
     int minh = (h < oh) ? h : oh;
 
-    struct tb_cell *prev = c->cells;
-
-    if_err_return(rv, cellbuf_init(c, w, h));
-    if_err_return(rv, cellbuf_clear(c));
+    // Grow the allocations only when they are too small. `realloc` keeps the
+    // old rows where they were, so they can be moved in place either way.
+    if (w * h > c->cap) {
+        struct tb_cell *cells = (struct tb_cell *)tb_realloc(c->cells,
+            sizeof(struct tb_cell) * w * h);
+        if (!cells) return TB_ERR_MEM;
+        c->cells = cells;
+        c->cap = w * h;
+    }
+    if (h > c->rows_cap) {
+        struct cellbuf_row *rows = (struct cellbuf_row *)tb_realloc(c->rows,
+            sizeof(struct cellbuf_row) * h);
+        if (!rows) return TB_ERR_MEM;
+        c->rows = rows;
+        c->rows_cap = h;
+    }
 
     int x, y;
-    for (x = 0; x < minw; x++) {
-        for (y = 0; y < minh; y++) {
-            struct tb_cell *src, *dst;
-            src = &prev[(y * ow) + x];
-            if_err_return(rv, cellbuf_get(c, x, y, &dst));
-            if_err_return(rv, cell_copy(dst, src));
+#ifdef TB_OPT_EGC
+    // Cells that fall off the edges own their clusters
+    for (y = 0; y < oh; y++) {
+        for (x = (y < minh) ? minw : 0; x < ow; x++) {
+            cell_free(&c->cells[(y * ow) + x]);
+        }
+    }
+#endif
+
+    // Move the kept rows to their new stride. Narrowing moves rows towards
+    // the start, so go top down; widening moves them away, so go bottom up.
+    if (w < ow) {
+        for (y = 1; y < minh; y++) {
+            memmove(&c->cells[y * w], &c->cells[y * ow],
+                sizeof(struct tb_cell) * minw);
+        }
+    } else if (w > ow) {
+        for (y = minh - 1; y > 0; y--) {
+            memmove(&c->cells[y * w], &c->cells[y * ow],
+                sizeof(struct tb_cell) * minw);
         }
     }
 
-    tb_free(prev);
+    c->width = w;
+    c->height = h;
+
+    // Newly exposed cells may hold stale copies of moved cells, so wipe them
+    // before clearing or they would share clusters with the originals
+    uint32_t space = (uint32_t)' ';
+    for (y = 0; y < h; y++) {
+        int x0 = (y < minh) ? minw : 0;
+        if (x0 >= w) continue;
+        memset(&c->cells[(y * w) + x0], 0, sizeof(struct tb_cell) * (w - x0));
+        for (x = x0; x < w; x++) {
+            if_err_return(rv, cell_set(&c->cells[(y * w) + x], &space, 1,
+                                  global.fg, global.bg));
+        }
+    }
+    for (y = minh; y < h; y++) {
+        c->rows[y].has_wide = 0;
+        c->rows[y].has_ech = 0;
+    }
+    cellbuf_dirty_all(c);
 
     return TB_OK;
 }
 
+static void cellbuf_dirty(struct cellbuf *c, int x, int y, int w) {
+    struct cellbuf_row *row = &c->rows[y];
+    if (w > 1) row->has_wide = 1;
+    if (w < 1) w = 1;
+    if (row->x0 >= row->x1) {
+        row->x0 = x;
+        row->x1 = x + w;
+        return;
+    }
+    if (x < row->x0) row->x0 = x;
+    if (x + w > row->x1) row->x1 = x + w;
+}
+
+static void cellbuf_dirty_all(struct cellbuf *c) {
+    int y;
+    for (y = 0; y < c->height; y++) {
+        c->rows[y].x0 = 0;
+        c->rows[y].x1 = c->width;
+    }
+}
+
 static int bytebuf_puts(struct bytebuf *b, const char *str) {
     if (!str || strlen(str) <= 0) return TB_OK; // Nothing to do for empty caps
     return bytebuf_nputs(b, str, (size_t)strlen(str));
@@ -4189,18 +6663,61 @@ static int bytebuf_shift(struct bytebuf *b, size_t n) {
     return TB_OK;
 }
 
+static int bytebuf_prepend(struct bytebuf *b, const char *str, size_t nstr) {
+    int rv;
+    if_err_return(rv, bytebuf_reserve(b, b->len + nstr + 1));
+    memmove(b->buf + nstr, b->buf, b->len + 1);
+    memcpy(b->buf, str, nstr);
+    b->len += nstr;
+    return TB_OK;
+}
+
 static int bytebuf_flush(struct bytebuf *b, int fd) {
-    if (b->len <= 0) return TB_OK;
-    ssize_t write_rv = write(fd, b->buf, b->len);
-    if (write_rv < 0 || (size_t)write_rv != b->len) {
-        // Note, errno will be 0 on partial write
-        global.last_errno = errno;
-        return TB_ERR;
+    while (b->len > 0) {
+        ssize_t write_rv = write(fd, b->buf, b->len);
+        if (write_rv < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Non-blocking fd is full, keep the rest for later
+                return TB_OK;
+            }
+            global.last_errno = errno;
+            return TB_ERR;
+        }
+        bytebuf_shift(b, (size_t)write_rv);
     }
-    b->len = 0;
     return TB_OK;
 }
 
+static int flush_out(void) {
+    size_t len = enc->out.len;
+    int rv = bytebuf_flush(&enc->out, global.wfd);
+    size_t sent = len - enc->out.len;
+    global.out_old = global.out_old > sent ? global.out_old - sent : 0;
+    global.out_pending = enc->out.len;
+    global.out_held = 0;
+    return rv;
+}
+
+// Take what `out` gained since the last count as the current frame's bytes.
+// Older bytes are always written first, so `flush_out` takes them off the
+// old ones, and a resize dropping a held frame leaves fewer than counted.
+static void count_frame(void) {
+    if (global.out_old > enc->out.len) global.out_old = enc->out.len;
+    global.out_frame = enc->out.len - global.out_old;
+    global.out_old = enc->out.len;
+}
+
+static int restore_wfd_flags(void) {
+    int rv = TB_OK;
+    if (fcntl(global.wfd, F_SETFL, global.wfd_flags) < 0) {
+        global.last_errno = errno;
+        rv = TB_ERR;
+    }
+    global.wfd_flags = -1;
+    return rv;
+}
+
 static int bytebuf_reserve(struct bytebuf *b, size_t sz) {
     if (b->cap >= sz) return TB_OK;
 